@@ -0,0 +1,172 @@
+/*
+ * Arenas for short-lived kernel allocations.
+ *
+ * An arena carves memory out of chunks obtained from the page frame
+ * allocator by bumping a pointer, and nothing allocated from it is freed
+ * on its own.  Instead arena_save() records the current position and
+ * arena_restore() returns to it, releasing everything allocated since in
+ * one step.  Marks nest, so that each piece of request-scoped work can undo
+ * exactly its own allocations.  None of this touches the heap's free
+ * lists, so transient buffers cannot fragment the heap.
+ *
+ * Chunks are linked from the newest to the oldest, and a chunk is given
+ * back to the frame allocator as soon as a restore leaves it unused.
+ */
+
+#include <system.h>
+#include <stdint.h>
+#include <arena.h>
+#include <buddy.h>
+
+
+struct arena_chunk {
+    struct arena_chunk *prev;   // Previous chunk of the arena.
+    unsigned int order;         // Buddy order of this chunk.
+};
+
+
+#define ALIGN                   8
+#define ALIGN_UP(x, a)          (((x) + (a) - 1) & ~(uintptr_t)((a) - 1))
+
+// Size of a chunk header, and first usable byte of a chunk.
+#define CHUNK_HDR_SIZE          ALIGN_UP(sizeof(struct arena_chunk), ALIGN)
+#define CHUNK_DATA(c)           ((char *)(c) + CHUNK_HDR_SIZE)
+
+
+static int new_chunk(arena_t *arena, size_t size);
+
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Initialize "arena" to be empty.
+ */
+void
+arena_init(arena_t *arena)
+{
+        arena->chunk = NULL;
+        arena->ptr = NULL;
+        arena->limit = NULL;
+}
+
+/*
+ * Requires:
+ *   "arena" was initialized by arena_init().
+ *
+ * Effects:
+ *   Allocate "size" bytes, aligned to 8 bytes, from "arena".  Returns the
+ *   address of the memory or NULL if a new chunk was needed and could not
+ *   be allocated.
+ */
+void *
+arena_alloc(arena_t *arena, size_t size)
+{
+        char *p;
+
+        size = ALIGN_UP(size, ALIGN);
+        if (size > (size_t)(arena->limit - arena->ptr) &&
+            new_chunk(arena, size) == -1)
+                return (NULL);
+
+        p = arena->ptr;
+        arena->ptr += size;
+        return (p);
+}
+
+/*
+ * Requires:
+ *   "arena" was initialized by arena_init().
+ *
+ * Effects:
+ *   Returns a mark for the current position of "arena".
+ */
+arena_mark_t
+arena_save(arena_t *arena)
+{
+        arena_mark_t mark;
+
+        mark.chunk = arena->chunk;
+        mark.ptr = arena->ptr;
+        return (mark);
+}
+
+/*
+ * Requires:
+ *   "mark" was returned by arena_save("arena"), and "arena" has not been
+ *   restored to an earlier mark since.
+ *
+ * Effects:
+ *   Release everything allocated from "arena" after "mark" was taken.
+ */
+void
+arena_restore(arena_t *arena, arena_mark_t mark)
+{
+        struct arena_chunk *c;
+
+        while ((c = arena->chunk) != mark.chunk) {
+                arena->chunk = c->prev;
+                buddy_free(c, c->order);
+        }
+
+        if ((c = arena->chunk) != NULL) {
+                arena->limit = (char *)c + (PAGE_SIZE << c->order);
+                arena->ptr = mark.ptr;
+        } else {
+                arena->limit = NULL;
+                arena->ptr = NULL;
+        }
+}
+
+/*
+ * Requires:
+ *   "arena" was initialized by arena_init().
+ *
+ * Effects:
+ *   Release everything allocated from "arena", leaving it empty.
+ */
+void
+arena_release(arena_t *arena)
+{
+        arena_mark_t empty = { NULL, NULL };
+
+        arena_restore(arena, empty);
+}
+
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   "size" is a multiple of ALIGN.
+ *
+ * Effects:
+ *   Start a new chunk with room for at least "size" bytes.  The rest of the
+ *   current chunk is abandoned until the arena is restored past it.
+ *   Returns 0 on success or -1 if no chunk could be allocated.
+ */
+static int
+new_chunk(arena_t *arena, size_t size)
+{
+        struct arena_chunk *c;
+        int order;
+
+        order = buddy_order(CHUNK_HDR_SIZE + size);
+        if (order == -1)
+                return (-1);
+        if (order < ARENA_CHUNK_ORDER)
+                order = ARENA_CHUNK_ORDER;
+
+        if ((c = buddy_alloc(order)) == NULL)
+                return (-1);
+
+        c->prev = arena->chunk;
+        c->order = order;
+        arena->chunk = c;
+        arena->ptr = CHUNK_DATA(c);
+        arena->limit = (char *)c + (PAGE_SIZE << order);
+        return (0);
+}
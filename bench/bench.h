@@ -0,0 +1,25 @@
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../include/memlib.h"
+#include "../include/malloc.h"
+
+/*
+ * The kernel allocator is built with its entry points renamed, so that it
+ * does not replace the C library's allocator.  See bench-malloc in the
+ * Makefile.
+ */
+extern void	*kmalloc(size_t size);
+extern void	 kfree(void *ptr);
+extern void	*krealloc(void *ptr, size_t size);
+extern void	*kmemalign(size_t align, size_t size);
+extern void	*kalloc_pages(size_t n);
+
+/* memlib.c */
+extern void	 mem_reset_brk(void);
+extern size_t	 mem_peak_heapsize(void);
+
+#endif //KERNEL_BENCH_H
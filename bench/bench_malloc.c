@@ -0,0 +1,579 @@
+/*
+ * Host-side benchmark for the kernel allocator in malloc.c.
+ *
+ * Replays allocation traces against malloc.c built for Linux on top of the
+ * mmap'd arena in bench/memlib.c, and reports for each trace:
+ *
+ *   Kops/s     -   Allocator operations per second (best of several runs).
+ *   util       -   Peak utilization: the largest total of live payload bytes
+ *                  divided by the largest size the heap reached.
+ *   frag       -   External fragmentation at the point of peak payload:
+ *                  1 - (largest free block / total free bytes).
+ *
+ * Trace files use the CS:APP format.  Four header numbers (suggested heap
+ * size, number of ids, number of operations, weight) are followed by one
+ * operation per line:
+ *
+ *   a <id> <bytes>             -   malloc
+ *   r <id> <bytes>             -   realloc
+ *   f <id>                     -   free
+ *   m <id> <align> <bytes>     -   memalign (extension)
+ *
+ * Every payload is filled with a pattern that is checked on realloc and
+ * free, so a broken allocator fails loudly instead of posting a number.
+ * With no arguments only the synthetic kernel workloads are run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+
+// Timed runs per trace; the best one is reported.
+#define RUNS            5
+
+// Operations in each synthetic workload.
+#define SYNTH_OPS       200000
+
+
+enum op_type {
+    OP_ALLOC,
+    OP_FREE,
+    OP_REALLOC,
+    OP_MEMALIGN,
+};
+
+struct op {
+    enum op_type type;
+    unsigned int id;
+    size_t size;
+    size_t align;
+};
+
+struct trace {
+    const char *name;
+    unsigned int num_ids;
+    unsigned int num_ops;
+    struct op *ops;
+};
+
+struct result {
+    double kops;
+    double util;
+    double frag;
+};
+
+
+static void **ptrs;             // Block for each id.
+static size_t *sizes;           // Payload size for each id.
+
+
+static struct trace *read_trace(const char *path);
+static struct trace *new_trace(const char *name, unsigned int num_ids,
+    unsigned int num_ops);
+static void free_trace(struct trace *t);
+
+static int check_run(struct trace *t, struct result *res);
+static void timed_run(struct trace *t, struct result *res);
+
+
+/*
+ * Fill and verify payloads with a byte pattern that depends on the id, so
+ * that blocks handed out twice or overwritten by the allocator are caught.
+ */
+static void
+fill(unsigned int id, unsigned char *p, size_t size)
+{
+        size_t i;
+
+        for (i = 0; i < size; i++)
+                p[i] = (unsigned char)(id + i);
+}
+
+static int
+verify(unsigned int id, const unsigned char *p, size_t size)
+{
+        size_t i;
+
+        for (i = 0; i < size; i++) {
+                if (p[i] != (unsigned char)(id + i))
+                        return (-1);
+        }
+        return (0);
+}
+
+
+/*
+ * A small xorshift generator, so that the synthetic workloads are the same
+ * on every run and every machine.
+ */
+static uint32_t rng_state;
+
+static uint32_t
+rng(void)
+{
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 17;
+        rng_state ^= rng_state << 5;
+        return (rng_state);
+}
+
+/*
+ * Pick a random id in [0, n) from the live or dead ids of "live".
+ */
+static unsigned int
+pick(const char *live, unsigned int n, int want_live)
+{
+        unsigned int id = rng() % n;
+
+        while ((live[id] != 0) != want_live)
+                id = (id + 1) % n;
+        return (id);
+}
+
+
+/*
+ * sleep(): short-lived 8 byte wait counters, allocated and freed in
+ * nearly LIFO order with only a handful alive at once.
+ */
+static struct trace *
+synth_sleep(void)
+{
+        struct trace *t = new_trace("synth:sleep", 16, SYNTH_OPS);
+        char live[16] = { 0 };
+        unsigned int i, nlive = 0, id;
+
+        for (i = 0; i < t->num_ops; i++) {
+                if (nlive < 16 && (nlive == 0 || rng() % 2)) {
+                        id = pick(live, 16, 0);
+                        t->ops[i] = (struct op){ OP_ALLOC, id, 8, 0 };
+                        live[id] = 1;
+                        nlive++;
+                } else {
+                        id = pick(live, 16, 1);
+                        t->ops[i] = (struct op){ OP_FREE, id, 0, 0 };
+                        live[id] = 0;
+                        nlive--;
+                }
+        }
+        return (t);
+}
+
+/*
+ * Input lines: buffers that start small and grow a few bytes at a time with
+ * realloc() up to a console line, interleaved with small scratch blocks.
+ */
+static struct trace *
+synth_lines(void)
+{
+        struct trace *t = new_trace("synth:lines", 64, SYNTH_OPS);
+        size_t len[32] = { 0 };
+        char live[32] = { 0 };
+        unsigned int i, id;
+
+        for (i = 0; i < t->num_ops; i++) {
+                id = rng() % 32;
+                if (rng() % 4 == 0) {
+                        // Scratch blocks use ids 32 to 63.
+                        if (live[id]) {
+                                t->ops[i] = (struct op){ OP_FREE, 32 + id,
+                                    0, 0 };
+                                live[id] = 0;
+                        } else {
+                                t->ops[i] = (struct op){ OP_ALLOC, 32 + id,
+                                    16 + rng() % 48, 0 };
+                                live[id] = 1;
+                        }
+                } else if (len[id] == 0) {
+                        len[id] = 16;
+                        t->ops[i] = (struct op){ OP_ALLOC, id, len[id], 0 };
+                } else if (len[id] >= 80) {
+                        len[id] = 0;
+                        t->ops[i] = (struct op){ OP_FREE, id, 0, 0 };
+                } else {
+                        len[id] += 1 + rng() % 8;
+                        t->ops[i] = (struct op){ OP_REALLOC, id, len[id], 0 };
+                }
+        }
+        return (t);
+}
+
+/*
+ * Page tables and buffers: page aligned pages mixed with small objects and
+ * the odd larger buffer, freed in random order.
+ */
+static struct trace *
+synth_pages(void)
+{
+        struct trace *t = new_trace("synth:pages", 1024, SYNTH_OPS);
+        char live[1024] = { 0 };
+        unsigned int i, nlive = 0, id, r;
+
+        for (i = 0; i < t->num_ops; i++) {
+                if (nlive < 512 && (nlive == 0 || rng() % 2)) {
+                        id = pick(live, 1024, 0);
+                        r = rng() % 8;
+                        if (r == 0)
+                                t->ops[i] = (struct op){ OP_MEMALIGN, id,
+                                    4096, 4096 };
+                        else if (r == 1)
+                                t->ops[i] = (struct op){ OP_ALLOC, id,
+                                    1024 + rng() % 8192, 0 };
+                        else
+                                t->ops[i] = (struct op){ OP_ALLOC, id,
+                                    8 + rng() % 120, 0 };
+                        live[id] = 1;
+                        nlive++;
+                } else {
+                        id = pick(live, 1024, 1);
+                        t->ops[i] = (struct op){ OP_FREE, id, 0, 0 };
+                        live[id] = 0;
+                        nlive--;
+                }
+        }
+        return (t);
+}
+
+/*
+ * General use: sizes spread over several orders of magnitude with random
+ * lifetimes, a steady state of a few thousand live blocks, and occasional
+ * resizing.
+ */
+static struct trace *
+synth_random(void)
+{
+        struct trace *t = new_trace("synth:random", 4096, SYNTH_OPS);
+        char live[4096] = { 0 };
+        unsigned int i, nlive = 0, id;
+
+        for (i = 0; i < t->num_ops; i++) {
+                if (nlive < 2048 && (nlive == 0 || rng() % 2)) {
+                        id = pick(live, 4096, 0);
+                        t->ops[i] = (struct op){ OP_ALLOC, id,
+                            1 + rng() % (16u << (rng() % 9)), 0 };
+                        live[id] = 1;
+                        nlive++;
+                } else if (rng() % 4 == 0) {
+                        id = pick(live, 4096, 1);
+                        t->ops[i] = (struct op){ OP_REALLOC, id,
+                            1 + rng() % (16u << (rng() % 9)), 0 };
+                } else {
+                        id = pick(live, 4096, 1);
+                        t->ops[i] = (struct op){ OP_FREE, id, 0, 0 };
+                        live[id] = 0;
+                        nlive--;
+                }
+        }
+        return (t);
+}
+
+
+int
+main(int argc, char **argv)
+{
+        struct trace *(*synth[])(void) = {
+                synth_sleep, synth_lines, synth_pages, synth_random,
+        };
+        unsigned int nsynth = sizeof(synth) / sizeof(synth[0]);
+        struct trace *t;
+        struct result res;
+        double kops_sum = 0, util_sum = 0;
+        int i, n = 0, err, failed = 0;
+
+        mem_init(0, 0);
+
+        printf("%-24s %9s %10s %7s %7s\n", "trace", "ops", "Kops/s",
+            "util", "frag");
+
+        for (i = 0; i < (int)nsynth + argc - 1; i++) {
+                if (i < (int)nsynth) {
+                        rng_state = 0x2545F491 + i;
+                        t = synth[i]();
+                } else if ((t = read_trace(argv[i - nsynth + 1])) == NULL) {
+                        failed = 1;
+                        continue;
+                }
+
+                ptrs = calloc(t->num_ids, sizeof(void *));
+                sizes = calloc(t->num_ids, sizeof(size_t));
+                if ((err = check_run(t, &res)) == 0)
+                        timed_run(t, &res);
+                failed |= err != 0;
+                free(ptrs);
+                free(sizes);
+                if (err) {
+                        free_trace(t);
+                        continue;
+                }
+
+                printf("%-24s %9u %10.1f %6.1f%% %6.1f%%\n", t->name,
+                    t->num_ops, res.kops, 100 * res.util, 100 * res.frag);
+                kops_sum += res.kops;
+                util_sum += res.util;
+                n++;
+                free_trace(t);
+        }
+
+        if (n > 0)
+                printf("%-24s %9s %10.1f %6.1f%%\n", "average", "",
+                    kops_sum / n, 100 * util_sum / n);
+
+        return (failed);
+}
+
+
+/*
+ * Requires:
+ *   "t" is a trace whose ids are all below t->num_ids.
+ *
+ * Effects:
+ *   Perform operation "i" of "t" on a fresh or ongoing replay, checking
+ *   payloads if "check" is set.  Returns the change in live payload bytes,
+ *   or sets "*err" if the allocator failed or corrupted a block.
+ */
+static long
+do_op(struct trace *t, unsigned int i, int check, int *err)
+{
+        struct op *op = &t->ops[i];
+        void *p;
+        long delta = 0;
+
+        switch (op->type) {
+        case OP_ALLOC:
+        case OP_MEMALIGN:
+                if (op->type == OP_ALLOC)
+                        p = kmalloc(op->size);
+                else
+                        p = kmemalign(op->align, op->size);
+                if (p == NULL || (op->align && (uintptr_t)p % op->align)) {
+                        fprintf(stderr, "%s: op %u: allocation failed\n",
+                            t->name, i);
+                        *err = 1;
+                        return (0);
+                }
+                if (check)
+                        fill(op->id, p, op->size);
+                ptrs[op->id] = p;
+                sizes[op->id] = op->size;
+                delta = op->size;
+                break;
+
+        case OP_REALLOC:
+                p = krealloc(ptrs[op->id], op->size);
+                if (p == NULL) {
+                        fprintf(stderr, "%s: op %u: realloc failed\n",
+                            t->name, i);
+                        *err = 1;
+                        return (0);
+                }
+                if (check) {
+                        if (verify(op->id, p, op->size < sizes[op->id] ?
+                            op->size : sizes[op->id]) != 0) {
+                                fprintf(stderr, "%s: op %u: realloc lost "
+                                    "data\n", t->name, i);
+                                *err = 1;
+                        }
+                        fill(op->id, p, op->size);
+                }
+                delta = (long)op->size - (long)sizes[op->id];
+                ptrs[op->id] = p;
+                sizes[op->id] = op->size;
+                break;
+
+        case OP_FREE:
+                if (check && verify(op->id, ptrs[op->id],
+                    sizes[op->id]) != 0) {
+                        fprintf(stderr, "%s: op %u: block corrupted\n",
+                            t->name, i);
+                        *err = 1;
+                }
+                kfree(ptrs[op->id]);
+                delta = -(long)sizes[op->id];
+                ptrs[op->id] = NULL;
+                sizes[op->id] = 0;
+                break;
+        }
+        return (delta);
+}
+
+/*
+ * Effects:
+ *   Start a replay of "t" on an empty heap.
+ */
+static void
+start_replay(struct trace *t)
+{
+        mem_reset_brk();
+        if (heap_init() != 0) {
+                fprintf(stderr, "heap_init failed\n");
+                exit(1);
+        }
+        memset(ptrs, 0, t->num_ids * sizeof(void *));
+        memset(sizes, 0, t->num_ids * sizeof(size_t));
+}
+
+/*
+ * Effects:
+ *   Replay "t" with payload checking and fill in the utilization and
+ *   fragmentation of "res".  Returns 0 if the allocator behaved and -1
+ *   otherwise.
+ */
+static int
+check_run(struct trace *t, struct result *res)
+{
+        struct heap_stats stats;
+        long payload = 0, peak = 0;
+        unsigned int i, peak_op = 0;
+        int err = 0;
+
+        start_replay(t);
+        for (i = 0; i < t->num_ops && !err; i++) {
+                payload += do_op(t, i, 1, &err);
+                if (payload > peak) {
+                        peak = payload;
+                        peak_op = i;
+                }
+        }
+        if (err)
+                return (-1);
+
+        res->util = mem_peak_heapsize() ? (double)peak / mem_peak_heapsize() :
+            1.0;
+
+        // Replay up to the peak again to look at the free blocks there.
+        start_replay(t);
+        for (i = 0; i <= peak_op && i < t->num_ops; i++)
+                do_op(t, i, 0, &err);
+        heap_get_stats(&stats);
+        res->frag = stats.bytes_free ?
+            1.0 - (double)stats.largest_free / stats.bytes_free : 0.0;
+
+        return (0);
+}
+
+static double
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+/*
+ * Effects:
+ *   Replay "t" RUNS times without payload checking and store the best
+ *   throughput in "res".
+ */
+static void
+timed_run(struct trace *t, struct result *res)
+{
+        double start, best = 0;
+        unsigned int i;
+        int run, err = 0;
+
+        for (run = 0; run < RUNS; run++) {
+                start_replay(t);
+                start = now();
+                for (i = 0; i < t->num_ops; i++)
+                        do_op(t, i, 0, &err);
+                start = now() - start;
+                if (run == 0 || start < best)
+                        best = start;
+        }
+        res->kops = best > 0 ? t->num_ops / best / 1000 : 0;
+}
+
+
+static struct trace *
+new_trace(const char *name, unsigned int num_ids, unsigned int num_ops)
+{
+        struct trace *t = malloc(sizeof(struct trace));
+
+        t->name = name;
+        t->num_ids = num_ids;
+        t->num_ops = num_ops;
+        t->ops = calloc(num_ops, sizeof(struct op));
+        return (t);
+}
+
+static void
+free_trace(struct trace *t)
+{
+        free(t->ops);
+        free(t);
+}
+
+/*
+ * Effects:
+ *   Read a CS:APP style trace from "path".  Returns the trace, or NULL if
+ *   it could not be read.
+ */
+static struct trace *
+read_trace(const char *path)
+{
+        struct trace *t;
+        unsigned int heap_size, num_ids, num_ops, weight, i;
+        const char *name;
+        struct op *op;
+        char type[2];
+        FILE *fp;
+
+        if ((fp = fopen(path, "r")) == NULL) {
+                perror(path);
+                return (NULL);
+        }
+        if (fscanf(fp, "%u %u %u %u", &heap_size, &num_ids, &num_ops,
+            &weight) != 4) {
+                fprintf(stderr, "%s: bad header\n", path);
+                fclose(fp);
+                return (NULL);
+        }
+
+        name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        t = new_trace(name, num_ids, num_ops);
+
+        for (i = 0; i < num_ops; i++) {
+                op = &t->ops[i];
+                if (fscanf(fp, "%1s %u", type, &op->id) != 2 ||
+                    op->id >= num_ids)
+                        break;
+
+                switch (type[0]) {
+                case 'a':
+                        op->type = OP_ALLOC;
+                        if (fscanf(fp, "%zu", &op->size) != 1)
+                                goto bad;
+                        break;
+                case 'r':
+                        op->type = OP_REALLOC;
+                        if (fscanf(fp, "%zu", &op->size) != 1)
+                                goto bad;
+                        break;
+                case 'm':
+                        op->type = OP_MEMALIGN;
+                        if (fscanf(fp, "%zu %zu", &op->align,
+                            &op->size) != 2)
+                                goto bad;
+                        break;
+                case 'f':
+                        op->type = OP_FREE;
+                        break;
+                default:
+                        goto bad;
+                }
+        }
+        if (i != num_ops) {
+bad:
+                fprintf(stderr, "%s: bad operation %u\n", path, i);
+                fclose(fp);
+                free_trace(t);
+                return (NULL);
+        }
+
+        fclose(fp);
+        return (t);
+}
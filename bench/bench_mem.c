@@ -0,0 +1,546 @@
+/*
+ * Host-side benchmark for the memory and string routines in string.c.
+ *
+ * For every power of two from 1 byte to 1 MiB, or 64 MiB for the first
+ * three, reports the throughput in MB/s of:
+ *
+ *   -  memcpy(), memset() and memsetw() against the old byte-at-a-time
+ *      loops, through both the string instruction and the SSE2 paths, to
+ *      show where the SSE2 path starts to pay off.
+ *   -  memmove() (overlapping, copying down), memcmp(), memchr(), strcmp(),
+ *      strncpy(), strchr() and strlen(), each scanning the whole buffer,
+ *      with the old byte-at-a-time strlen() for comparison.
+ *
+ * Before timing, each routine is checked against the C library at every
+ * source and destination misalignment, with guard bytes around each
+ * destination and with strings that end right before an unmapped page,
+ * so a broken routine fails loudly instead of posting a number.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "../include/cpu.h"
+
+
+// Largest size checked, and the largest size measured by bench_str().
+#define MAX_SIZE        (1 << 20)
+
+// Largest size measured by bench().
+#define BENCH_MAX_SIZE  (64 << 20)
+
+// Cache size given to kstring_init() for the SSE2 pass, so that the checks
+// cover that path over several chunks and bench() times it below the
+// real threshold too.
+#define CHECK_CACHE_SIZE        (64 * 1024)
+
+// Bytes moved per timed run, spread over as many calls as it takes.
+#define BYTES_PER_RUN   (16 << 20)
+
+// Timed runs per size; the best one is reported.
+#define RUNS            3
+
+// Guard bytes around each checked destination.
+#define GUARD           64
+
+
+/*
+ * string.c is built with its entry points renamed, so that it does not
+ * replace the C library's.  See bench-mem in the Makefile.
+ */
+extern void	 kstring_init(void);
+extern void	*kmemcpy(void *dest, const void *src, size_t count);
+extern void	*kmemset(void *dest, char val, size_t count);
+extern unsigned short *kmemsetw(unsigned short *dest, unsigned short val,
+		    size_t count);
+extern void	*kmemmove(void *dest, const void *src, size_t count);
+extern int	 kmemcmp(const void *s1, const void *s2, size_t count);
+extern void	*kmemchr(const void *s, int c, size_t count);
+extern int	 kstrcmp(const char *s1, const char *s2);
+extern char	*kstrncpy(char *dest, const char *src, size_t count);
+extern char	*kstrchr(const char *s, int c);
+extern size_t	 kstrlen(const char *str);
+
+// string.c masks interrupts around its SSE2 paths.
+unsigned int irq_save(void) { return (0); }
+void irq_restore(unsigned int flags) { (void)flags; }
+
+// Features and cache size of the host CPU, set in main() for
+// kstring_init().
+uint32_t cpu_features;
+uint32_t cpu_cache_size;
+
+/*
+ * Effects:
+ *   Patch a jump into the host's text like the kernel's cpu_patch_jump(),
+ *   after making the text writable.
+ */
+void
+cpu_patch_jump(void *from, void *to)
+{
+        uintptr_t page = (uintptr_t)from & ~(uintptr_t)4095;
+        int32_t rel = (intptr_t)to - ((intptr_t)from + 5);
+        unsigned char *p = from;
+
+        if (mprotect((void *)page, 2 * 4096, PROT_READ | PROT_WRITE |
+            PROT_EXEC) != 0) {
+                perror("mprotect");
+                exit(1);
+        }
+        p[0] = 0xE9;
+        memcpy(p + 1, &rel, sizeof(rel));
+}
+
+
+static void *byte_memcpy(void *dest, const void *src, size_t count);
+static void *byte_memset(void *dest, char val, size_t count);
+static unsigned short *byte_memsetw(unsigned short *dest, unsigned short val,
+    size_t count);
+static size_t byte_strlen(const char *str);
+static void check(void);
+static void check_str(void);
+static void bench(int sse2);
+static void bench_str(void);
+static int sign(int x);
+static double now(void);
+
+
+static unsigned char *src_buf, *dest_buf;
+
+// Keeps results the compiler would otherwise throw away.
+static volatile size_t sink;
+
+
+int
+main(void)
+{
+        src_buf = aligned_alloc(4096, BENCH_MAX_SIZE + 2 * 4096);
+        dest_buf = aligned_alloc(4096, BENCH_MAX_SIZE + 2 * 4096);
+        if (src_buf == NULL || dest_buf == NULL) {
+                perror("aligned_alloc");
+                return (1);
+        }
+        memset(src_buf, 0x5A, BENCH_MAX_SIZE + 2 * 4096);
+        memset(dest_buf, 0, BENCH_MAX_SIZE + 2 * 4096);
+
+        // Check and time the string instruction paths first.
+        check();
+        printf("%8s %10s %10s %10s %10s %10s %10s\n", "size",
+            "byte cpy", "memcpy", "byte set", "memset", "byte setw",
+            "memsetw");
+        printf("-- rep movsd / rep stosd --\n");
+        bench(0);
+
+        if (__builtin_cpu_supports("sse2"))
+                cpu_features |= CPU_SSE2;
+        cpu_cache_size = CHECK_CACHE_SIZE;
+        kstring_init();
+        check();
+        printf("-- SSE2 non-temporal stores from %d KiB on --\n",
+            CHECK_CACHE_SIZE / 1024);
+        bench(1);
+
+        check_str();
+        printf("\n%8s %10s %10s %10s %10s %10s %10s %10s %10s\n", "size",
+            "memmove", "memcmp", "memchr", "strcmp", "strncpy", "strchr",
+            "strlen", "byte len");
+        bench_str();
+
+        return (0);
+}
+
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * The routines string.c replaced, for comparison.  They are kept out of
+ * line so that they pay for a call like the kernel routines do.
+ */
+__attribute__((noinline)) static void *
+byte_memcpy(void *dest, const void *src, size_t count)
+{
+        const volatile char *sp = (const char *)src;
+        volatile char *dp = (char *)dest;
+        for(; count != 0; count--) *dp++ = *sp++;
+        return dest;
+}
+
+__attribute__((noinline)) static void *
+byte_memset(void *dest, char val, size_t count)
+{
+        volatile char *temp = (char *)dest;
+        for( ; count != 0; count--) *temp++ = val;
+        return dest;
+}
+
+__attribute__((noinline)) static unsigned short *
+byte_memsetw(unsigned short *dest, unsigned short val, size_t count)
+{
+        volatile unsigned short *temp = (unsigned short *)dest;
+        for( ; count != 0; count--) *temp++ = val;
+        return dest;
+}
+
+__attribute__((noinline)) static size_t
+byte_strlen(const char *str)
+{
+        const volatile char *s = str;
+        size_t retval;
+        for(retval = 0; *s != '\0'; s++) retval++;
+        return retval;
+}
+
+/*
+ * Effects:
+ *   Check kmemcpy(), kmemset() and kmemsetw() at every misalignment for a
+ *   range of sizes around the thresholds, exiting on the first mismatch.
+ */
+static void
+check(void)
+{
+        static const size_t sizes[] = { 0, 1, 2, 3, 4, 5, 7, 15, 16, 17, 31,
+            63, 64, 65, 127, 255, 1000, 4096, 65535, MAX_SIZE - 1, MAX_SIZE,
+            MAX_SIZE + 1, MAX_SIZE + 255 };
+        unsigned char *d;
+        unsigned short *w;
+        size_t i, j, k, n;
+        int soff, doff;
+
+        for (i = 0; i < MAX_SIZE + 4096; i++)
+                src_buf[i] = (unsigned char)(i * 7 + 3);
+
+        for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+                n = sizes[k];
+                for (soff = 0; soff < 16; soff++)
+                for (doff = 0; doff < 16; doff++) {
+                        d = dest_buf + GUARD + doff;
+                        memset(dest_buf, 0xEE, n + 2 * GUARD + 16);
+                        if (kmemcpy(d, src_buf + soff, n) != d ||
+                            memcmp(d, src_buf + soff, n) != 0)
+                                goto fail_cpy;
+                        for (j = 0; j < GUARD; j++)
+                                if (d[-1 - (long)j] != 0xEE || d[n + j] != 0xEE)
+                                        goto fail_cpy;
+
+                        memset(dest_buf, 0xEE, n + 2 * GUARD + 16);
+                        if (kmemset(d, (char)0xA7, n) != d)
+                                goto fail_set;
+                        for (j = 0; j < n; j++)
+                                if (d[j] != 0xA7)
+                                        goto fail_set;
+                        for (j = 0; j < GUARD; j++)
+                                if (d[-1 - (long)j] != 0xEE || d[n + j] != 0xEE)
+                                        goto fail_set;
+                }
+                for (doff = 0; doff < 16; doff += 2) {
+                        w = (unsigned short *)(dest_buf + GUARD + doff);
+                        memset(dest_buf, 0xEE, 2 * n + 2 * GUARD + 16);
+                        if (kmemsetw(w, 0x1F2E, n) != w)
+                                goto fail_setw;
+                        for (j = 0; j < n; j++)
+                                if (w[j] != 0x1F2E)
+                                        goto fail_setw;
+                        d = (unsigned char *)w;
+                        for (j = 0; j < GUARD; j++)
+                                if (d[-1 - (long)j] != 0xEE ||
+                                    d[2 * n + j] != 0xEE)
+                                        goto fail_setw;
+                }
+        }
+        return;
+
+fail_cpy:
+        fprintf(stderr, "memcpy: wrong result, size %zu offsets %d/%d\n",
+            n, soff, doff);
+        exit(1);
+fail_set:
+        fprintf(stderr, "memset: wrong result, size %zu offset %d\n", n, doff);
+        exit(1);
+fail_setw:
+        fprintf(stderr, "memsetw: wrong result, count %zu offset %d\n", n,
+            doff);
+        exit(1);
+}
+
+/*
+ * Effects:
+ *   Check the remaining routines against the C library, exiting on the
+ *   first mismatch.  Strings end right before an unmapped page, so that
+ *   reading past their null byte into the next page faults.
+ */
+static void
+check_str(void)
+{
+        static const size_t sizes[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17,
+            31, 32, 33, 63, 64, 65, 255, 4096, 65537 };
+        char *page, *end, *s1, *s2, *p;
+        unsigned char ref[256 + 2 * GUARD], *d;
+        size_t i, k, n, cnt;
+        int off, off2, delta;
+
+        page = mmap(NULL, 3 * 4096, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED || mprotect(page + 2 * 4096, 4096,
+            PROT_NONE) != 0) {
+                perror("mmap");
+                exit(1);
+        }
+        end = page + 2 * 4096;
+
+        for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+                n = sizes[k];
+
+                // memmove() in both directions at every small overlap.
+                for (delta = -17; delta <= 17; delta++)
+                for (off = 0; off < 8; off++) {
+                        d = dest_buf + GUARD + 32 + off;
+                        p = (char *)src_buf + GUARD + 32 + off;
+                        for (i = 0; i < n + 2 * GUARD; i++)
+                                dest_buf[i] = (unsigned char)(i * 13 + 1);
+                        memcpy(src_buf, dest_buf, n + 2 * GUARD);
+                        for (i = 0; i < n; i++)
+                                p[delta + (long)i] = d[i];
+                        if (kmemmove(d + delta, d, n) != d + delta ||
+                            memcmp(dest_buf, src_buf, n + 2 * GUARD) != 0) {
+                                fprintf(stderr, "memmove: wrong result, "
+                                    "size %zu delta %d\n", n, delta);
+                                exit(1);
+                        }
+                }
+
+                // memcmp() and memchr() with the difference at every place.
+                for (off = 0; off < 8; off++)
+                for (off2 = 0; off2 < 8; off2++) {
+                        s1 = (char *)src_buf + off;
+                        s2 = (char *)dest_buf + off2;
+                        memset(s1, 'a', n);
+                        memset(s2, 'a', n);
+                        if (kmemcmp(s1, s2, n) != 0 ||
+                            kmemchr(s1, 'b', n) != NULL)
+                                goto fail_mem;
+                        for (i = 0; i < n && i < 80; i++) {
+                                s2[i] = (i & 1) ? 'b' : '0';
+                                if (sign(kmemcmp(s1, s2, n)) !=
+                                    sign(memcmp(s1, s2, n)) ||
+                                    sign(kmemcmp(s2, s1, n)) !=
+                                    sign(memcmp(s2, s1, n)) ||
+                                    kmemchr(s2, s2[i], n) != s2 + i)
+                                        goto fail_mem;
+                                s2[i] = 'a';
+                        }
+                }
+
+                // String routines on strings ending at the unmapped page.
+                if (n >= 4096)
+                        continue;
+                for (off = 0; off < 8; off++) {
+                        s1 = end - n - 1 - off;
+                        memset(s1, 'a', n);
+                        s1[n] = '\0';
+                        if (kstrlen(s1) != n || kstrchr(s1, '\0') != s1 + n ||
+                            kstrchr(s1, 'b') != NULL)
+                                goto fail_str;
+                        for (i = 0; i < n; i++) {
+                                s1[i] = 'b';
+                                if (kstrchr(s1, 'b') != s1 + i)
+                                        goto fail_str;
+                                s1[i] = 'a';
+                        }
+
+                        // Against a second string at every other alignment.
+                        for (off2 = 0; off2 < 8; off2++) {
+                                s2 = end - 4096 - n - 1 - off2;
+                                memcpy(s2, s1, n + 1);
+                                if (kstrcmp(s1, s2) != 0 || kstrcmp(s2, s1))
+                                        goto fail_str;
+                                for (i = 0; i <= n && i < 80; i++) {
+                                        s2[i] = (i & 1) ? 'b' : '\0';
+                                        if (sign(kstrcmp(s1, s2)) !=
+                                            sign(strcmp(s1, s2)) ||
+                                            sign(kstrcmp(s2, s1)) !=
+                                            sign(strcmp(s2, s1)))
+                                                goto fail_str;
+                                        s2[i] = s1[i];
+                                }
+                        }
+
+                        // strncpy() short of, at and past the null byte.
+                        for (off2 = 0; off2 < 8; off2++)
+                        for (cnt = 0; cnt < n + 16 && cnt < 256; cnt++) {
+                                d = dest_buf + GUARD + off2;
+                                memset(dest_buf, 0xEE, sizeof(ref));
+                                memset(ref, 0xEE, sizeof(ref));
+                                strncpy((char *)ref + GUARD + off2, s1, cnt);
+                                if (kstrncpy((char *)d, s1, cnt) != (char *)d ||
+                                    memcmp(dest_buf, ref, sizeof(ref)) != 0) {
+                                        fprintf(stderr, "strncpy: wrong "
+                                            "result, length %zu count %zu\n",
+                                            n, cnt);
+                                        exit(1);
+                                }
+                        }
+                }
+        }
+
+        // strcmp() with the second string running onto a page boundary.
+        for (off = 1; off < 8; off++) {
+                s1 = (char *)src_buf;
+                p = end - 4096 - off;
+                memset(s1, 'x', 64);
+                memset(p - 32, 'x', 32 + off - 1);
+                s1[32 + off - 1] = '\0';
+                p[off - 1] = '\0';
+                if (kstrcmp(s1, p - 32) != 0)
+                        goto fail_str;
+        }
+
+        munmap(page, 3 * 4096);
+        return;
+
+fail_mem:
+        fprintf(stderr, "memcmp/memchr: wrong result, size %zu offsets "
+            "%d/%d\n", n, off, off2);
+        exit(1);
+fail_str:
+        fprintf(stderr, "strlen/strchr/strcmp: wrong result, length %zu "
+            "offset %d\n", n, off);
+        exit(1);
+}
+
+/*
+ * Effects:
+ *   Print one line per size with the best throughput of each routine.
+ *   The byte loops are only timed in the first pass.
+ */
+static void
+bench(int sse2)
+{
+        double best[6], t;
+        size_t size, calls, i;
+        int fn, run;
+
+        for (size = 1; size <= BENCH_MAX_SIZE; size *= 2) {
+                calls = size < BYTES_PER_RUN ? BYTES_PER_RUN / size : 1;
+                for (fn = 0; fn < 6; fn++) {
+                        best[fn] = 0;
+                        if (sse2 && fn % 2 == 0)
+                                continue;
+                        for (run = 0; run < RUNS; run++) {
+                                t = now();
+                                for (i = 0; i < calls; i++) {
+                                        switch (fn) {
+                                        case 0: byte_memcpy(dest_buf,
+                                            src_buf, size); break;
+                                        case 1: kmemcpy(dest_buf, src_buf,
+                                            size); break;
+                                        case 2: byte_memset(dest_buf, 1,
+                                            size); break;
+                                        case 3: kmemset(dest_buf, 1, size);
+                                            break;
+                                        case 4: byte_memsetw((unsigned short *)
+                                            dest_buf, 1, size / 2); break;
+                                        case 5: kmemsetw((unsigned short *)
+                                            dest_buf, 1, size / 2); break;
+                                        }
+                                }
+                                t = now() - t;
+                                if (run == 0 || t < best[fn])
+                                        best[fn] = t;
+                        }
+                }
+
+                printf("%8zu", size);
+                for (fn = 0; fn < 6; fn++) {
+                        if (best[fn] == 0)
+                                printf(" %10s", "-");
+                        else
+                                printf(" %10.0f", (double)calls * size /
+                                    best[fn] / 1e6);
+                }
+                printf("\n");
+        }
+}
+
+/*
+ * Effects:
+ *   Print one line per size with the best throughput of each of the
+ *   remaining routines, each made to scan the whole buffer.
+ */
+static void
+bench_str(void)
+{
+        double best[8], t;
+        size_t size, calls, i;
+        int fn, run;
+
+        memset(src_buf, 'a', MAX_SIZE + 4096);
+        memset(dest_buf, 'a', MAX_SIZE + 4096);
+        for (size = 1; size <= MAX_SIZE; size *= 2) {
+                calls = BYTES_PER_RUN / size;
+                src_buf[size] = '\0';
+                dest_buf[size + 1] = '\0';
+                for (fn = 0; fn < 8; fn++) {
+                        for (run = 0; run < RUNS; run++) {
+                                t = now();
+                                for (i = 0; i < calls; i++) {
+                                        switch (fn) {
+                                        case 0: kmemmove(src_buf + 1,
+                                            src_buf, size); break;
+                                        case 1: sink = kmemcmp(src_buf,
+                                            dest_buf + 1, size); break;
+                                        case 2: sink = (size_t)kmemchr(
+                                            src_buf, 'z', size); break;
+                                        case 3: sink = kstrcmp((char *)
+                                            src_buf, (char *)dest_buf + 1);
+                                            break;
+                                        case 4: kstrncpy((char *)dest_buf + 8,
+                                            (char *)src_buf, size); break;
+                                        case 5: sink = (size_t)kstrchr((char *)
+                                            src_buf, 'z'); break;
+                                        case 6: sink = kstrlen((char *)
+                                            src_buf); break;
+                                        case 7: sink = byte_strlen((char *)
+                                            src_buf); break;
+                                        }
+                                }
+                                t = now() - t;
+                                if (run == 0 || t < best[fn])
+                                        best[fn] = t;
+                        }
+                        // memmove() and strncpy() smear the buffers.
+                        memset(src_buf, 'a', size + 1);
+                        memset(dest_buf, 'a', size + 16);
+                        src_buf[size] = '\0';
+                        dest_buf[size + 1] = '\0';
+                }
+                src_buf[size] = 'a';
+                dest_buf[size + 1] = 'a';
+
+                printf("%8zu", size);
+                for (fn = 0; fn < 8; fn++)
+                        printf(" %10.0f", (double)calls * size / best[fn] /
+                            1e6);
+                printf("\n");
+        }
+}
+
+static int
+sign(int x)
+{
+        return ((x > 0) - (x < 0));
+}
+
+static double
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (ts.tv_sec + ts.tv_nsec * 1e-9);
+}
@@ -0,0 +1,137 @@
+/*
+ * Host stand-in for the kernel's memlib.c and the few other kernel services
+ * that malloc.c uses, so that malloc.c can be built unchanged for Linux.
+ * The heap lives in an mmap'd arena in place of the memory after the
+ * kernel image.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "bench.h"
+
+
+// Largest heap the arena can hold.
+#define ARENA_SIZE      (1UL << 28)
+
+
+static char *mem_start_brk;     // First byte of the heap.
+static char *mem_brk;           // First byte past the heap.
+static char *mem_max_addr;      // First byte past the arena.
+static char *mem_high_water;    // Largest break since mem_reset_brk().
+
+
+/*
+ * Effects:
+ *   Map the arena and set up an empty heap.  The arguments are ignored.
+ */
+void
+mem_init(uintptr_t mem_start, uintptr_t mem_top)
+{
+        (void)mem_start;
+        (void)mem_top;
+
+        mem_start_brk = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem_start_brk == MAP_FAILED) {
+                perror("mmap");
+                exit(1);
+        }
+
+        mem_max_addr = mem_start_brk + ARENA_SIZE;
+        mem_reset_brk();
+}
+
+/*
+ * Effects:
+ *   Empty the heap, so that heap_init() can start over.
+ */
+void
+mem_reset_brk(void)
+{
+        mem_brk = mem_start_brk;
+        mem_high_water = mem_start_brk;
+}
+
+/*
+ * Effects:
+ *   Move the break by "incr" bytes.  Returns the old break, or (void *)-1
+ *   if the heap cannot be moved that far.
+ */
+void *
+mem_sbrk(intptr_t incr)
+{
+        char *old_brk = mem_brk;
+
+        if (incr > mem_max_addr - mem_brk || -incr > mem_brk - mem_start_brk)
+                return ((void *)-1);
+
+        mem_brk += incr;
+        if (mem_brk > mem_high_water)
+                mem_high_water = mem_brk;
+        return (old_brk);
+}
+
+void *
+mem_heap_lo(void)
+{
+        return (mem_start_brk);
+}
+
+void *
+mem_heap_hi(void)
+{
+        return (mem_brk - 1);
+}
+
+size_t
+mem_heapsize(void)
+{
+        return (mem_brk - mem_start_brk);
+}
+
+/*
+ * Effects:
+ *   Returns the largest size the heap reached since mem_reset_brk().
+ */
+size_t
+mem_peak_heapsize(void)
+{
+        return (mem_high_water - mem_start_brk);
+}
+
+
+/* Console and interrupt services used by malloc.c. */
+
+void
+putnum(unsigned int num)
+{
+        printf("%u", num);
+}
+
+void
+putch(char c)
+{
+        putchar(c);
+}
+
+void
+swi_install_handler(int swi, void (*handler)(void *r))
+{
+        (void)swi;
+        (void)handler;
+}
+
+unsigned int
+irq_save(void)
+{
+        return (0);
+}
+
+void
+irq_restore(unsigned int flags)
+{
+        (void)flags;
+}
@@ -0,0 +1,305 @@
+/*
+ * Binary buddy allocator for physical page frames.
+ *
+ * Frames are handed out in blocks of 2^order frames, from a single 4 KiB
+ * frame (order 0) up to 4 MiB (order BUDDY_MAX_ORDER).  A block is aligned
+ * to its own size in physical memory, so its buddy, the other half of the
+ * block of the next order it was split from, is found by flipping one bit
+ * of its frame number.  Every order has
+ * its own free list, and a bitmap of the non-empty lists finds the smallest
+ * order able to satisfy a request with one bit scan.  Allocating splits and
+ * freeing merges at most BUDDY_MAX_ORDER times.
+ *
+ * The allocator holds no memory of its own at first.  When no free block
+ * is large enough, it takes a 4 MiB chunk from the frame allocator with
+ * frame_alloc_contig(), or a chunk just the size of the request if memory
+ * is too fragmented for that.  Blocks never merge past the chunk they came
+ * from, and a chunk that is whole again is given back, unless that would
+ * leave less than a chunk free, so that one allocation going back and
+ * forth does not take and return a chunk each time.
+ *
+ * Each frame below the top given to buddy_init() has a small descriptor,
+ * in an array taken from the frame allocator.  Only the descriptor of the
+ * first frame of a free block or a chunk is used: it links the block into
+ * its free list and records its order, and marks where a chunk starts.
+ */
+
+#include <system.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <frame.h>
+#include <buddy.h>
+
+
+struct frame {
+    struct frame *prev, *next;  // Free list links.
+    unsigned char order;        // Order of the free block starting here.
+    unsigned char chunk;        // Order + 1 of a chunk starting here, or 0.
+    bool free;                  // Set if a free block starts here.
+};
+
+
+#define PAGE_ALIGN(x)   (((x) + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1))
+
+// Page frame number of an address and address of a page frame number.
+#define PFN(addr)       ((uintptr_t)(addr) / PAGE_SIZE)
+#define PFN_ADDR(pfn)   ((void *)((pfn) * PAGE_SIZE))
+
+#define BLOCK_FRAMES(order)     ((uintptr_t)1 << (order))
+
+// Descriptor of a frame and frame number of a descriptor.
+#define FRAME(pfn)      (&frames[pfn])
+#define FRAME_PFN(f)    ((uintptr_t)((f) - frames))
+
+
+static struct frame *frames;    // Descriptors, from frame 0 on.
+static uintptr_t end_pfn;       // One past the last frame described.
+
+static struct frame free_lists[BUDDY_MAX_ORDER + 1];
+static uint32_t nonempty;       // Bit i set if free_lists[i] is non-empty.
+static size_t nr_free;          // Free frames.
+
+
+static bool grow(unsigned int order);
+static void insert_block(struct frame *f, unsigned int order);
+static void remove_block(struct frame *f);
+
+
+/*
+ * Requires:
+ *   The frame allocator is set up, and memory below "top" is identity
+ *   mapped.
+ *
+ * Effects:
+ *   Set up the descriptors of the frames below "top", which blocks are
+ *   then taken from.  If there is no room for them nothing can be
+ *   allocated.
+ */
+void
+buddy_init(uintptr_t top)
+{
+        unsigned int order;
+        size_t size;
+
+        for (order = 0; order <= BUDDY_MAX_ORDER; order++) {
+                free_lists[order].next = &free_lists[order];
+                free_lists[order].prev = &free_lists[order];
+        }
+        nonempty = 0;
+        nr_free = 0;
+
+        end_pfn = PFN(top);
+        size = PAGE_ALIGN(end_pfn * sizeof(struct frame));
+        if ((frames = frame_alloc_contig(size / PAGE_SIZE, PAGE_SIZE)) ==
+            NULL) {
+                end_pfn = 0;
+                return;
+        }
+        memset(frames, 0, size);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocate 2^"order" contiguous page frames, aligned to their size,
+ *   taking more frames from the frame allocator if no free block is large
+ *   enough.  Returns the physical address of the first frame or NULL if
+ *   there is no such run.
+ */
+void *
+buddy_alloc(unsigned int order)
+{
+        struct frame *f;
+        unsigned int flags, k;
+        uint32_t bins;
+
+        if (order > BUDDY_MAX_ORDER)
+                return (NULL);
+
+        flags = irq_save();
+
+        // Take a block from the smallest non-empty list that is large enough.
+        if ((bins = nonempty & ~(BLOCK_FRAMES(order) - 1)) == 0) {
+                if (!grow(order)) {
+                        irq_restore(flags);
+                        return (NULL);
+                }
+                bins = nonempty & ~(BLOCK_FRAMES(order) - 1);
+        }
+        k = __builtin_ctz(bins);
+        f = free_lists[k].next;
+        remove_block(f);
+
+        // Split it, giving back the upper halves.
+        while (k > order) {
+                k--;
+                insert_block(f + BLOCK_FRAMES(k), k);
+        }
+        nr_free -= BLOCK_FRAMES(order);
+
+        irq_restore(flags);
+
+        return (PFN_ADDR(FRAME_PFN(f)));
+}
+
+/*
+ * Requires:
+ *   "addr" was returned by buddy_alloc("order") and has not been freed.
+ *
+ * Effects:
+ *   Free the block, merging it with its buddy for as long as the buddy is
+ *   free and whole and the chunk it came from is not whole.  A whole chunk
+ *   is given back to the frame allocator if more than a chunk's worth of
+ *   frames stays free.
+ */
+void
+buddy_free(void *addr, unsigned int order)
+{
+        struct frame *b;
+        uintptr_t pfn, buddy, i;
+        unsigned int flags;
+
+        if (addr == NULL)
+                return;
+
+        pfn = PFN(addr);
+
+        flags = irq_save();
+
+        nr_free += BLOCK_FRAMES(order);
+        while (FRAME(pfn)->chunk != order + 1) {
+                buddy = pfn ^ BLOCK_FRAMES(order);
+                if (buddy >= end_pfn)
+                        break;
+                b = FRAME(buddy);
+                if (!b->free || b->order != order)
+                        break;
+                remove_block(b);
+                pfn &= ~BLOCK_FRAMES(order);
+                order++;
+        }
+
+        if (FRAME(pfn)->chunk == order + 1 &&
+            nr_free - BLOCK_FRAMES(order) >= BLOCK_FRAMES(BUDDY_MAX_ORDER)) {
+                FRAME(pfn)->chunk = 0;
+                nr_free -= BLOCK_FRAMES(order);
+                for (i = 0; i < BLOCK_FRAMES(order); i++)
+                        frame_free(PFN_ADDR(pfn + i));
+        } else {
+                insert_block(FRAME(pfn), order);
+        }
+
+        irq_restore(flags);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the smallest order whose blocks hold "size" bytes, or -1 if
+ *   "size" is larger than BUDDY_MAX_SIZE.
+ */
+int
+buddy_order(size_t size)
+{
+        int order;
+
+        for (order = 0; order <= BUDDY_MAX_ORDER; order++) {
+                if (size <= (size_t)PAGE_SIZE << order)
+                        return (order);
+        }
+        return (-1);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the number of free page frames.
+ */
+size_t
+buddy_free_pages(void)
+{
+        return (nr_free);
+}
+
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   Interrupts are disabled.
+ *
+ * Effects:
+ *   Take a chunk of free frames from the frame allocator into the free
+ *   lists: a 4 MiB one if there is one, or else one of 2^"order" frames.
+ *   Returns false if there is neither.
+ */
+static bool
+grow(unsigned int order)
+{
+        unsigned int k = BUDDY_MAX_ORDER;
+        void *chunk;
+
+        if (frames == NULL)
+                return (false);
+
+        if ((chunk = frame_alloc_contig(BLOCK_FRAMES(k), PAGE_SIZE << k)) ==
+            NULL) {
+                k = order;
+                chunk = frame_alloc_contig(BLOCK_FRAMES(k), PAGE_SIZE << k);
+        }
+        if (chunk == NULL)
+                return (false);
+
+        FRAME(PFN(chunk))->chunk = k + 1;
+        insert_block(FRAME(PFN(chunk)), k);
+        nr_free += BLOCK_FRAMES(k);
+
+        return (true);
+}
+
+/*
+ * Requires:
+ *   "f" is the first frame of a free block of 2^"order" frames that is not
+ *   in any free list.
+ *
+ * Effects:
+ *   Insert the block at the head of the free list for "order".
+ */
+static void
+insert_block(struct frame *f, unsigned int order)
+{
+        struct frame *list = &free_lists[order];
+
+        f->order = order;
+        f->free = true;
+        f->prev = list;
+        f->next = list->next;
+        list->next->prev = f;
+        list->next = f;
+        nonempty |= 1u << order;
+}
+
+/*
+ * Requires:
+ *   "f" is the first frame of a free block in a free list.
+ *
+ * Effects:
+ *   Remove the block from its free list.
+ */
+static void
+remove_block(struct frame *f)
+{
+        f->free = false;
+        f->prev->next = f->next;
+        f->next->prev = f->prev;
+        if (free_lists[f->order].next == &free_lists[f->order])
+                nonempty &= ~(1u << f->order);
+}
@@ -0,0 +1,335 @@
+/*
+ * CPU feature detection and boot-time code patching.
+ *
+ * cpu_init() runs CPUID once at boot and records what the processor
+ * supports in cpu_features, which the rest of the kernel tests with
+ * cpu_has() instead of running CPUID again.  It also records in
+ * cpu_cache_size how much of the largest data cache one thread can count
+ * on, which is the cache's size divided by the threads sharing it, and
+ * turns on SSE when the CPU has it.
+ *
+ * Code with variants for different CPUs is not chosen with a test on every
+ * call.  Instead the default variant is a PATCHABLE function, and once the
+ * features are known the nops it starts with are overwritten with a jump
+ * to the best variant, in the manner of Linux alternatives.  Callers keep a
+ * direct call, and the patched function costs one direct jump.  This is
+ * only done at boot, before the patched code can run on another CPU or in
+ * an interrupt handler.
+ */
+
+#include <system.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <cpu.h>
+
+
+// Registers returned by CPUID.
+struct cpuid_regs {
+    uint32_t eax, ebx, ecx, edx;
+};
+
+// A feature and the CPUID leaf 1 register bit telling that it exists.
+struct cpuid_bit {
+    uint32_t feature;           // CPU_* bit.
+    bool ecx;                   // Bit of ECX rather than EDX.
+    unsigned int bit;
+};
+
+static const struct cpuid_bit leaf1_bits[] = {
+    { CPU_PSE,          false,  3 },
+    { CPU_TSC,          false,  4 },
+    { CPU_MSR,          false,  5 },
+    { CPU_APIC,         false,  9 },
+    { CPU_SEP,          false, 11 },
+    { CPU_PGE,          false, 13 },
+    { CPU_PAT,          false, 16 },
+    { CPU_FXSR,         false, 24 },
+    { CPU_SSE,          false, 25 },
+    { CPU_SSE2,         false, 26 },
+    { CPU_MWAIT,        true,   3 },
+    { CPU_SSE42,        true,  20 },
+    { CPU_POPCNT,       true,  23 },
+};
+
+// CPUID leaf 0x80000007 EDX bit telling that the TSC is invariant.
+#define CPUID_TSC_INVARIANT     (1 << 8)
+
+// Types of cache in CPUID leaf 4 EAX.
+#define CACHE_NONE              0
+#define CACHE_DATA              1
+#define CACHE_UNIFIED           3
+
+// Subleaves of leaf 4 looked at, in case a broken CPUID never ends them.
+#define CACHE_MAX_LEAVES        16
+
+#define EFLAGS_ID               (1 << 21)
+
+#define CR0_MP                  (1 << 1)
+#define CR0_EM                  (1 << 2)
+#define CR4_OSFXSR              (1 << 9)
+#define CR4_OSXMMEXCPT          (1 << 10)
+
+// Opcode of jmp rel32, which takes PATCH_SIZE bytes.
+#define JMP_REL32               0xE9
+
+
+uint32_t cpu_features;
+uint32_t cpu_cache_size;
+
+// Address monitored by mwait_idle().  Nothing writes it; interrupts end
+// the wait.
+static volatile uint32_t idle_monitor;
+
+
+static bool has_cpuid(void);
+static void cpuid(uint32_t leaf, struct cpuid_regs *r);
+static void cpuid_count(uint32_t leaf, uint32_t sub, struct cpuid_regs *r);
+static uint32_t cache_size(uint32_t max, uint32_t max_ext);
+static void sse_init(void);
+static void mwait_idle(void);
+
+
+/*
+ * Requires:
+ *   Interrupts are disabled.
+ *
+ * Effects:
+ *   Find the features and the cache size of the CPU, turn on SSE if it
+ *   has it, and patch cpu_idle() to its best variant.
+ */
+void
+cpu_init(void)
+{
+        struct cpuid_regs r;
+        uint32_t max, max_ext, reg, family, model, stepping;
+        unsigned int i;
+
+        cpu_features = 0;
+        cpu_cache_size = 0;
+        if (!has_cpuid())
+                return;
+
+        cpuid(0, &r);
+        max = r.eax;
+        if (max < 1)
+                return;
+
+        cpuid(1, &r);
+        for (i = 0; i < sizeof(leaf1_bits) / sizeof(leaf1_bits[0]); i++) {
+                reg = leaf1_bits[i].ecx ? r.ecx : r.edx;
+                if (reg & (1u << leaf1_bits[i].bit))
+                        cpu_features |= leaf1_bits[i].feature;
+        }
+
+        // The Pentium Pro reports SEP without really having sysenter.
+        family = (r.eax >> 8) & 0xF;
+        model = (r.eax >> 4) & 0xF;
+        stepping = r.eax & 0xF;
+        if (family == 6 && model < 3 && stepping < 3)
+                cpu_features &= ~CPU_SEP;
+
+        cpuid(0x80000000, &r);
+        max_ext = r.eax;
+        if (max_ext >= 0x80000007) {
+                cpuid(0x80000007, &r);
+                if (r.edx & CPUID_TSC_INVARIANT)
+                        cpu_features |= CPU_TSC_INVARIANT;
+        }
+        cpu_cache_size = cache_size(max, max_ext);
+
+        // SSE state is saved with fxsave, so SSE is no use without it.
+        if (cpu_has(CPU_SSE) && cpu_has(CPU_FXSR))
+                sse_init();
+        else
+                cpu_features &= ~(CPU_SSE | CPU_SSE2 | CPU_SSE42);
+
+        if (cpu_has(CPU_MWAIT))
+                cpu_patch_jump(cpu_idle, mwait_idle);
+}
+
+/*
+ * Requires:
+ *   "from" is a PATCHABLE function that is not running and cannot be
+ *   called until this returns, and "to" takes the same arguments.
+ *
+ * Effects:
+ *   Make every later call to "from" continue at "to".
+ */
+void
+cpu_patch_jump(void *from, void *to)
+{
+        unsigned char *p = from;
+        int32_t rel = (uintptr_t)to - ((uintptr_t)from + PATCH_SIZE);
+        struct cpuid_regs r;
+        unsigned int flags;
+
+        flags = irq_save();
+        p[0] = JMP_REL32;
+        memcpy(p + 1, &rel, sizeof(rel));
+
+        // Serialize, so that no stale copy of the old code is run.
+        cpuid(0, &r);
+        irq_restore(flags);
+}
+
+/*
+ * Requires:
+ *   None.  A caller that looks for work first should disable interrupts
+ *   before looking, so that an interrupt arriving in between still ends
+ *   the wait.
+ *
+ * Effects:
+ *   Enable interrupts and wait for the next one with hlt.  Patched to
+ *   mwait_idle() on CPUs that have mwait.
+ */
+PATCHABLE void
+cpu_idle(void)
+{
+        __asm__ __volatile__("sti; hlt" : : : "memory");
+}
+
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns true if the CPU has CPUID, which it does if EFLAGS.ID can be
+ *   flipped.
+ */
+static bool
+has_cpuid(void)
+{
+        uint32_t before, after;
+
+        __asm__ __volatile__(
+            "pushfl\n\t"
+            "pushfl\n\t"
+            "popl %0\n\t"
+            "movl %0, %1\n\t"
+            "xorl %2, %1\n\t"
+            "pushl %1\n\t"
+            "popfl\n\t"
+            "pushfl\n\t"
+            "popl %1\n\t"
+            "popfl"
+            : "=&r" (before), "=&r" (after) : "i" (EFLAGS_ID) : "cc");
+        return (((before ^ after) & EFLAGS_ID) != 0);
+}
+
+/*
+ * Requires:
+ *   The CPU has CPUID.
+ *
+ * Effects:
+ *   Run CPUID leaf "leaf" into "r".
+ */
+static void
+cpuid(uint32_t leaf, struct cpuid_regs *r)
+{
+        cpuid_count(leaf, 0, r);
+}
+
+/*
+ * Requires:
+ *   The CPU has CPUID.
+ *
+ * Effects:
+ *   Run CPUID leaf "leaf", subleaf "sub", into "r".
+ */
+static void
+cpuid_count(uint32_t leaf, uint32_t sub, struct cpuid_regs *r)
+{
+        __asm__ __volatile__("cpuid" : "=a" (r->eax), "=b" (r->ebx),
+            "=c" (r->ecx), "=d" (r->edx) : "a" (leaf), "c" (sub));
+}
+
+/*
+ * Requires:
+ *   The CPU has CPUID, with standard leaves up to "max" and extended ones
+ *   up to "max_ext".
+ *
+ * Effects:
+ *   Returns the largest share in bytes of a data or unified cache that
+ *   one thread has, each cache divided by the threads sharing it, from
+ *   the cache parameters of leaf 4.  On CPUs without them, returns the
+ *   larger of the L2 and L3 sizes of leaf 0x80000006, or 0 if that is not
+ *   there either.
+ */
+static uint32_t
+cache_size(uint32_t max, uint32_t max_ext)
+{
+        struct cpuid_regs r;
+        uint32_t size, best = 0, type, i;
+
+        if (max >= 4) {
+                for (i = 0; i < CACHE_MAX_LEAVES; i++) {
+                        cpuid_count(4, i, &r);
+                        if ((type = r.eax & 0x1F) == CACHE_NONE)
+                                break;
+                        if (type != CACHE_DATA && type != CACHE_UNIFIED)
+                                continue;
+                        // Ways, partitions, line size and sets, less one,
+                        // over the threads sharing it, less one.
+                        size = ((r.ebx >> 22) + 1) *
+                            (((r.ebx >> 12) & 0x3FF) + 1) *
+                            ((r.ebx & 0xFFF) + 1) * (r.ecx + 1) /
+                            (((r.eax >> 14) & 0xFFF) + 1);
+                        if (size > best)
+                                best = size;
+                }
+        }
+
+        if (best == 0 && max_ext >= 0x80000006) {
+                // L2 in KiB in ECX, L3 in units of 512 KiB in EDX.
+                cpuid(0x80000006, &r);
+                best = (r.ecx >> 16) * 1024;
+                if ((r.edx >> 18) * 512 * 1024 > best)
+                        best = (r.edx >> 18) * 512 * 1024;
+        }
+
+        return (best);
+}
+
+/*
+ * Requires:
+ *   The CPU has SSE and fxsave.
+ *
+ * Effects:
+ *   Let SSE instructions run: no FPU emulation, and fxsave support and
+ *   unmasked SIMD exceptions reported as #XM in CR4.
+ */
+static void
+sse_init(void)
+{
+        uint32_t cr;
+
+        __asm__ __volatile__("movl %%cr0, %0" : "=r" (cr));
+        cr = (cr & ~CR0_EM) | CR0_MP;
+        __asm__ __volatile__("movl %0, %%cr0" : : "r" (cr));
+
+        __asm__ __volatile__("movl %%cr4, %0" : "=r" (cr));
+        cr |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+        __asm__ __volatile__("movl %0, %%cr4" : : "r" (cr));
+}
+
+/*
+ * Requires:
+ *   The CPU has monitor and mwait.
+ *
+ * Effects:
+ *   Enable interrupts and wait for the next one with mwait, on an address
+ *   nothing writes.  The sti takes effect only once mwait has started
+ *   waiting, so no interrupt is missed in between.
+ */
+static void
+mwait_idle(void)
+{
+        __asm__ __volatile__("monitor" : : "a" (&idle_monitor), "c" (0),
+            "d" (0));
+        __asm__ __volatile__("sti; mwait" : : "a" (0), "c" (0) : "memory");
+}
@@ -0,0 +1,375 @@
+/*
+ * Bitmap allocator for physical page frames.
+ *
+ * At boot the memory map passed by the boot loader is turned into a bitmap
+ * with one bit per 4 KiB frame, set if the frame is in use.  Frames that
+ * are not RAM, the memory below 1 MiB, the kernel image and the bitmap
+ * itself start out set.
+ *
+ * frame_alloc() looks at 32 frames at a time: a word that is not all ones
+ * holds a free frame, found with a single bit scan of its complement.  A
+ * hint cursor remembers the lowest word that may still hold a free frame,
+ * so consecutive allocations find one in the first word they look at and
+ * frees below the cursor move it back.
+ *
+ * Each frame also has a reference count, for frames mapped into more than
+ * one address space.  Allocation sets it to one and the frame is freed
+ * when frame_unref() drops it to zero.
+ */
+
+#include <system.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <malloc.h>
+#include <frame.h>
+
+
+#define PAGE_ALIGN(x)   (((x) + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1))
+
+#define PFN(addr)       ((uintptr_t)(addr) / PAGE_SIZE)
+#define PFN_ADDR(pfn)   ((void *)((pfn) * PAGE_SIZE))
+
+#define WORD_BITS       32
+#define FULL_WORD       0xFFFFFFFF
+
+#define TEST_BIT(pfn)   (bitmap[(pfn) / WORD_BITS] & (1u << (pfn) % WORD_BITS))
+#define SET_BIT(pfn)    (bitmap[(pfn) / WORD_BITS] |= 1u << (pfn) % WORD_BITS)
+#define CLEAR_BIT(pfn)  (bitmap[(pfn) / WORD_BITS] &= ~(1u << (pfn) % WORD_BITS))
+
+
+// Kernel image bounds, from link.ld.
+extern char code[], end[];
+
+static uint32_t *bitmap;        // Bit i set if frame i is in use.
+static uint16_t *refs;          // Reference count of each frame.
+static uintptr_t nframes;       // Frames described by the bitmap.
+static uintptr_t nwords;        // Words in the bitmap.
+static uintptr_t hint;          // No free frame below this word.
+static size_t nr_free;          // Free frames.
+
+
+static void mark_range(uint64_t lo, uint64_t hi, bool used);
+static void mark_map(struct multiboot_info *mbi, bool used);
+static uint64_t highest_ram(struct multiboot_info *mbi, uint64_t limit);
+
+
+/*
+ * Requires:
+ *   "mbi" is the information passed by the boot loader, or NULL if there
+ *   is none.  Memory is identity mapped.
+ *
+ * Effects:
+ *   Build the frame bitmap for the RAM below "limit".  The bitmap and the
+ *   reference counts are placed right after the kernel image.
+ */
+void
+frame_init(struct multiboot_info *mbi, uintptr_t limit)
+{
+        uint64_t top;
+
+        top = highest_ram(mbi, limit);
+        nframes = PFN(top);
+        nwords = (nframes + WORD_BITS - 1) / WORD_BITS;
+
+        // Everything is in use until the map says it is RAM.
+        bitmap = (uint32_t *)PAGE_ALIGN((uintptr_t)end);
+        memset(bitmap, 0xFF, nwords * sizeof(uint32_t));
+        refs = (uint16_t *)(bitmap + nwords);
+        memset(refs, 0, nframes * sizeof(uint16_t));
+        nr_free = 0;
+        hint = 0;
+
+        if (mbi != NULL && (mbi->flags & MULTIBOOT_INFO_MEM_MAP)) {
+                // Entries may overlap, so the reserved ones are applied last.
+                mark_map(mbi, false);
+                mark_map(mbi, true);
+        } else {
+                mark_range(FRAME_LOW_RESERVED, top, false);
+        }
+
+        mark_range(0, FRAME_LOW_RESERVED, true);
+        mark_range((uintptr_t)code, (uintptr_t)end, true);
+        mark_range((uintptr_t)bitmap, (uintptr_t)(refs + nframes), true);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocate a page frame.  Returns its physical address or NULL if every
+ *   frame is in use.
+ */
+void *
+frame_alloc(void)
+{
+        unsigned int flags;
+        uintptr_t i, pfn;
+
+        flags = irq_save();
+
+        for (i = hint; i < nwords && bitmap[i] == FULL_WORD; i++)
+                ;
+        hint = i;
+        if (i == nwords) {
+                irq_restore(flags);
+                return (NULL);
+        }
+
+        // The tail of the last word is marked used, so this is in range.
+        pfn = i * WORD_BITS + __builtin_ctz(~bitmap[i]);
+        SET_BIT(pfn);
+        refs[pfn] = 1;
+        nr_free--;
+
+        irq_restore(flags);
+
+        return (PFN_ADDR(pfn));
+}
+
+/*
+ * Requires:
+ *   "frame" was returned by frame_alloc() or frame_alloc_contig() and has
+ *   not been freed.
+ *
+ * Effects:
+ *   Free the page frame at "frame", whatever its reference count.
+ */
+void
+frame_free(void *frame)
+{
+        uintptr_t pfn = PFN(frame);
+        unsigned int flags;
+
+        flags = irq_save();
+
+        CLEAR_BIT(pfn);
+        refs[pfn] = 0;
+        nr_free++;
+        if (pfn / WORD_BITS < hint)
+                hint = pfn / WORD_BITS;
+
+        irq_restore(flags);
+}
+
+/*
+ * Requires:
+ *   "frame" is an allocated page frame.
+ *
+ * Effects:
+ *   Take another reference to "frame".
+ */
+void
+frame_ref(void *frame)
+{
+        unsigned int flags;
+
+        flags = irq_save();
+        refs[PFN(frame)]++;
+        irq_restore(flags);
+}
+
+/*
+ * Requires:
+ *   "frame" is an allocated page frame.
+ *
+ * Effects:
+ *   Drop a reference to "frame", freeing it with the last one.  Returns the
+ *   number of references left.
+ */
+unsigned int
+frame_unref(void *frame)
+{
+        unsigned int flags, n;
+
+        flags = irq_save();
+        if ((n = --refs[PFN(frame)]) == 0)
+                frame_free(frame);
+        irq_restore(flags);
+
+        return (n);
+}
+
+/*
+ * Requires:
+ *   "frame" is an allocated page frame.
+ *
+ * Effects:
+ *   Returns the number of references to "frame".
+ */
+unsigned int
+frame_refcount(void *frame)
+{
+        return (refs[PFN(frame)]);
+}
+
+/*
+ * Requires:
+ *   "align" is a power of two and a multiple of PAGE_SIZE.
+ *
+ * Effects:
+ *   Allocate "n" contiguous page frames, the first aligned to "align"
+ *   bytes.  Returns the physical address of the first frame or NULL if
+ *   there is no such run.  This scans frame by frame and is meant for
+ *   memory pools taking large runs now and then, such as the buddy
+ *   allocator.
+ */
+void *
+frame_alloc_contig(size_t n, size_t align)
+{
+        uintptr_t step = PFN(align), pfn, i;
+        unsigned int flags;
+
+        if (n == 0)
+                return (NULL);
+
+        flags = irq_save();
+
+        for (pfn = 0; pfn + n <= nframes; pfn += step) {
+                for (i = 0; i < n && !TEST_BIT(pfn + i); i++)
+                        ;
+                if (i == n)
+                        break;
+                // Start over at the first aligned frame past the used one.
+                pfn = ((pfn + i) & ~(step - 1));
+        }
+        if (pfn + n > nframes) {
+                irq_restore(flags);
+                return (NULL);
+        }
+
+        for (i = 0; i < n; i++) {
+                SET_BIT(pfn + i);
+                refs[pfn + i] = 1;
+        }
+        nr_free -= n;
+
+        irq_restore(flags);
+
+        return (PFN_ADDR(pfn));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the number of free page frames.
+ */
+size_t
+frame_free_count(void)
+{
+        return (nr_free);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the address one past the highest frame described.
+ */
+uintptr_t
+frame_mem_top(void)
+{
+        return ((uintptr_t)PFN_ADDR(nframes));
+}
+
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Mark the frames touching [lo, hi) as used, or the frames lying wholly
+ *   inside it as free.  Frames past the bitmap are ignored.
+ */
+static void
+mark_range(uint64_t lo, uint64_t hi, bool used)
+{
+        uint64_t first, last, pfn;
+
+        if (used) {
+                first = lo / PAGE_SIZE;
+                last = (hi + PAGE_SIZE - 1) / PAGE_SIZE;
+        } else {
+                first = (lo + PAGE_SIZE - 1) / PAGE_SIZE;
+                last = hi / PAGE_SIZE;
+        }
+        if (last > nframes)
+                last = nframes;
+
+        for (pfn = first; pfn < last; pfn++) {
+                if (used && !TEST_BIT(pfn)) {
+                        SET_BIT(pfn);
+                        nr_free--;
+                } else if (!used && TEST_BIT(pfn)) {
+                        CLEAR_BIT(pfn);
+                        nr_free++;
+                }
+        }
+}
+
+/*
+ * Requires:
+ *   "mbi" has a memory map.
+ *
+ * Effects:
+ *   Mark the reserved ranges of the memory map as used if "used" is set,
+ *   or its RAM as free otherwise.
+ */
+static void
+mark_map(struct multiboot_info *mbi, bool used)
+{
+        struct multiboot_mmap_entry *e;
+        uintptr_t mmap_end;
+
+        mmap_end = mbi->mmap_addr + mbi->mmap_length;
+        for (e = (struct multiboot_mmap_entry *)mbi->mmap_addr;
+            (uintptr_t)e < mmap_end;
+            e = (struct multiboot_mmap_entry *)((char *)e + e->size +
+            sizeof(e->size))) {
+                if ((e->type != MULTIBOOT_MEMORY_AVAILABLE) == used)
+                        mark_range(e->addr, e->addr + e->len, used);
+        }
+}
+
+/*
+ * Requires:
+ *   "mbi" is the information passed by the boot loader, or NULL.
+ *
+ * Effects:
+ *   Returns the end of the highest RAM below "limit", taken from the
+ *   memory map, the memory size, or FRAME_DEFAULT_TOP in that order.
+ */
+static uint64_t
+highest_ram(struct multiboot_info *mbi, uint64_t limit)
+{
+        struct multiboot_mmap_entry *e;
+        uint64_t top = 0;
+        uintptr_t mmap_end;
+
+        if (mbi != NULL && (mbi->flags & MULTIBOOT_INFO_MEM_MAP)) {
+                mmap_end = mbi->mmap_addr + mbi->mmap_length;
+                for (e = (struct multiboot_mmap_entry *)mbi->mmap_addr;
+                    (uintptr_t)e < mmap_end;
+                    e = (struct multiboot_mmap_entry *)((char *)e +
+                    e->size + sizeof(e->size))) {
+                        if (e->type == MULTIBOOT_MEMORY_AVAILABLE &&
+                            e->addr + e->len > top)
+                                top = e->addr + e->len;
+                }
+        } else if (mbi != NULL && (mbi->flags & MULTIBOOT_INFO_MEMORY)) {
+                top = FRAME_LOW_RESERVED + (uint64_t)mbi->mem_upper * 1024;
+        } else {
+                top = FRAME_DEFAULT_TOP;
+        }
+
+        if (top > limit)
+                top = limit;
+        return (top & ~(uint64_t)(PAGE_SIZE - 1));
+}
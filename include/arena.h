@@ -0,0 +1,30 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+typedef struct arena {
+    struct arena_chunk *chunk;  // Chunk being carved, NULL if none.
+    char *ptr;                  // Next free byte in the chunk.
+    char *limit;                // First byte past the chunk.
+} arena_t;
+
+// Position in an arena to return to, from arena_save().
+typedef struct arena_mark {
+    struct arena_chunk *chunk;
+    char *ptr;
+} arena_mark_t;
+
+extern void		 arena_init(arena_t *arena);
+extern void		*arena_alloc(arena_t *arena, size_t size);
+extern arena_mark_t	 arena_save(arena_t *arena);
+extern void		 arena_restore(arena_t *arena, arena_mark_t mark);
+extern void		 arena_release(arena_t *arena);
+
+
+// Smallest chunk taken from the page frame allocator, as a buddy order.
+#define ARENA_CHUNK_ORDER       2
+
+#endif //KERNEL_ARENA_H
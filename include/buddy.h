@@ -0,0 +1,19 @@
+#ifndef __BUDDY_H
+#define __BUDDY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <malloc.h>
+
+extern void	 buddy_init(uintptr_t top);
+extern void	*buddy_alloc(unsigned int order);
+extern void	 buddy_free(void *addr, unsigned int order);
+extern int	 buddy_order(size_t size);
+extern size_t	 buddy_free_pages(void);
+
+
+// Largest block is 2^BUDDY_MAX_ORDER pages (4 MiB).
+#define BUDDY_MAX_ORDER         10
+#define BUDDY_MAX_SIZE          (PAGE_SIZE << BUDDY_MAX_ORDER)
+
+#endif //KERNEL_BUDDY_H
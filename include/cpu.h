@@ -0,0 +1,48 @@
+#ifndef __CPU_H
+#define __CPU_H
+
+#include <stdint.h>
+
+extern void	cpu_init(void);
+extern void	cpu_patch_jump(void *from, void *to);
+extern void	cpu_idle(void);
+
+// Features found by cpu_init(), as CPU_* bits.
+extern uint32_t	cpu_features;
+
+// Bytes of cache one thread can count on, found by cpu_init(), 0 if it is
+// not known.
+extern uint32_t	cpu_cache_size;
+
+
+// Features cpu_init() looks for.
+#define CPU_PSE                 (1 << 0)        // 4 MiB pages.
+#define CPU_TSC                 (1 << 1)        // Time stamp counter.
+#define CPU_MSR                 (1 << 2)        // rdmsr and wrmsr.
+#define CPU_APIC                (1 << 3)        // Local APIC.
+#define CPU_SEP                 (1 << 4)        // sysenter and sysexit.
+#define CPU_PGE                 (1 << 5)        // Global pages.
+#define CPU_PAT                 (1 << 6)        // Page Attribute Table.
+#define CPU_FXSR                (1 << 7)        // fxsave and fxrstor.
+#define CPU_SSE                 (1 << 8)        // Enabled by cpu_init().
+#define CPU_SSE2                (1 << 9)
+#define CPU_SSE42               (1 << 10)
+#define CPU_MWAIT               (1 << 11)       // monitor and mwait.
+#define CPU_POPCNT              (1 << 12)
+#define CPU_TSC_INVARIANT       (1 << 13)       // TSC rate never changes.
+
+#define cpu_has(feature)        ((cpu_features & (feature)) != 0)
+
+// Bytes cpu_patch_jump() writes at the start of a function: a jmp rel32.
+#define PATCH_SIZE              5
+
+/*
+ * Marks a function that cpu_patch_jump() may redirect.  It must not be
+ * inlined or have its body assumed by its callers, and it starts with
+ * PATCH_SIZE bytes of nops, so that the jump written over them never
+ * reaches past the function however short its body is.
+ */
+#define PATCHABLE \
+        __attribute__((__noipa__, __patchable_function_entry__(PATCH_SIZE, 0)))
+
+#endif //KERNEL_CPU_H
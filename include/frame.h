@@ -0,0 +1,25 @@
+#ifndef __FRAME_H
+#define __FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <multiboot.h>
+
+extern void		 frame_init(struct multiboot_info *mbi, uintptr_t limit);
+extern void		*frame_alloc(void);
+extern void		 frame_free(void *frame);
+extern void		 frame_ref(void *frame);
+extern unsigned int	 frame_unref(void *frame);
+extern unsigned int	 frame_refcount(void *frame);
+extern void		*frame_alloc_contig(size_t n, size_t align);
+extern size_t		 frame_free_count(void);
+extern uintptr_t	 frame_mem_top(void);
+
+
+// Memory assumed if the boot loader reports neither a map nor a size.
+#define FRAME_DEFAULT_TOP       (1 << 24)
+
+// Memory below this is left to the BIOS and devices.
+#define FRAME_LOW_RESERVED      0x100000
+
+#endif //KERNEL_FRAME_H
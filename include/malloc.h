@@ -6,10 +6,42 @@ extern int	 heap_init(void);
 extern void	*malloc(size_t size);
 extern void	 free(void *ptr);
 extern void	*realloc(void *ptr, size_t size);
+extern void	*memalign(size_t align, size_t size);
+extern void	*alloc_pages(size_t n);
 
 
-extern void *heap;
+// Number of size classes reported in struct heap_stats.
+#define HEAP_STAT_CLASSES       16
 
-#define HEAP_SIZE        (1 << 22)
+/*
+ * Heap snapshot.  Size class i counts free blocks of at least 2^(i + 5)
+ * bytes and less than twice that; the last class counts all larger ones.
+ * Blocks cached in the per-CPU magazines count as neither allocated nor
+ * free, but as cached.  Call counts include calls made by realloc() and
+ * memalign().
+ */
+struct heap_stats {
+    size_t heap_size;
+    size_t bytes_allocated;
+    size_t bytes_free;
+    size_t largest_free;
+    size_t bytes_cached;
+    unsigned int allocated_blocks;
+    unsigned int free_blocks[HEAP_STAT_CLASSES];
+    unsigned long malloc_calls;
+    unsigned long free_calls;
+    unsigned long realloc_calls;
+    unsigned long failed_allocs;
+};
+
+extern void	 heap_get_stats(struct heap_stats *stats);
+extern void	 heap_print_stats(void);
+
+// Software interrupt returning a snapshot in EBX, or printing it if EBX is 0.
+#define SWI_HEAP_STATS          1
+
+
+#define HEAP_INIT_SIZE   (1 << 16)
+#define PAGE_SIZE        (1 << 12)
 
 #endif //KERNEL_MALLOC_H
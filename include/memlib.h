@@ -0,0 +1,13 @@
+#ifndef __MEMLIB_H
+#define __MEMLIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern void	 mem_init(uintptr_t mem_start, uintptr_t mem_top);
+extern void	*mem_sbrk(intptr_t incr);
+extern void	*mem_heap_lo(void);
+extern void	*mem_heap_hi(void);
+extern size_t	 mem_heapsize(void);
+
+#endif //KERNEL_MEMLIB_H
@@ -0,0 +1,46 @@
+#ifndef __MULTIBOOT_H
+#define __MULTIBOOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Value left in EAX by a Multiboot compliant boot loader.
+#define MULTIBOOT_BOOTLOADER_MAGIC      0x2BADB002
+
+// Bits in multiboot_info.flags.
+#define MULTIBOOT_INFO_MEMORY           (1 << 0)
+#define MULTIBOOT_INFO_MEM_MAP          (1 << 6)
+
+// Type of usable RAM in a memory map entry.
+#define MULTIBOOT_MEMORY_AVAILABLE      1
+
+
+/*
+ * Information structure passed by the boot loader in EBX.
+ * Only the fields up to the memory map are described here.
+ */
+struct multiboot_info {
+    uint32_t flags;
+    uint32_t mem_lower;         // KiB of memory below 1 MiB.
+    uint32_t mem_upper;         // KiB of memory above 1 MiB.
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+} __attribute__((packed));
+
+/*
+ * Memory map entry.  "size" does not count itself, so the next entry
+ * starts size + 4 bytes after this one.
+ */
+struct multiboot_mmap_entry {
+    uint32_t size;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} __attribute__((packed));
+
+#endif //KERNEL_MULTIBOOT_H
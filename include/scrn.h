@@ -15,4 +15,8 @@ void getcurline(char *buf);
 
 void putnum(unsigned int num);
 
+#ifdef SCRN_BENCH
+void scrn_bench(void);
+#endif
+
 #endif //KERNEL_SCRN_H
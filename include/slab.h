@@ -0,0 +1,19 @@
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+#include <malloc.h>
+
+typedef struct kmem_cache kmem_cache_t;
+
+extern kmem_cache_t	*kmem_cache_create(const char *name, size_t size,
+			    size_t align, void (*ctor)(void *));
+extern void		 kmem_cache_destroy(kmem_cache_t *cache);
+extern void		*kmem_cache_alloc(kmem_cache_t *cache);
+extern void		 kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+
+// Size of the block each slab is carved from.
+#define SLAB_SIZE       PAGE_SIZE
+
+#endif //KERNEL_SLAB_H
@@ -5,6 +5,7 @@
 #ifndef __STDINT_H
 #define __STDINT_H
 
-typedef unsigned int uintptr_t;
+typedef __UINTPTR_TYPE__ uintptr_t;
+typedef __INTPTR_TYPE__ intptr_t;
 
 #endif //__STDINT_H
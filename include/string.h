@@ -7,8 +7,26 @@
 #define __STRING_H
 
 
+void string_init(void);
+void *memcpy(void *dest, const void *src, size_t count);
+void *memset(void *dest, char val, size_t count);
+unsigned short *memsetw(unsigned short *dest,
+    unsigned short val, size_t count);
+void *memmove(void *dest, const void *src, size_t count);
+int memcmp(const void *s1, const void *s2, size_t count);
+void *memchr(const void *s, int c, size_t count);
+int strcmp(const char *s1, const char *s2);
+char *strncpy(char *dest, const char *src, size_t count);
+char *strchr(const char *s, int c);
 size_t strlen(const char *str);
 
 
+// Copies and fills at least as large as the cache a thread has bypass it
+// when SSE2 is available; this size is used if that is not known.
+#define MEM_NT_THRESHOLD        (1024 * 1024)
+
+// Non-temporal copies and fills run this many bytes at a time with
+// interrupts disabled.
+#define MEM_NT_CHUNK            (64 * 1024)
 
 #endif //KERNEL_STRING_H
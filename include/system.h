@@ -1,5 +1,6 @@
 
 #include <stddef.h>
+#include <string.h>
 #include <malloc.h>
 #include <scrn.h>
 
@@ -13,13 +14,19 @@
 
 #define GetInInterrupt(arg) __asm__("int %0\n" : : "N"((arg)) : "cc", "memory")
 
+
+// Only the boot processor runs kernel code for now.
+#define NR_CPUS                 1
+#define smp_processor_id()      0
+
 /* MAIN.C */
-void *memcpy(void *dest, const void *src, size_t count);
-void *memset(void *dest, char val, size_t count);
-unsigned short *memsetw(unsigned short *dest,
-    unsigned short val, size_t count);
 unsigned char inportb(unsigned short _port);
 void outportb(unsigned short _port, unsigned char _data);
+unsigned int irq_save(void);
+void irq_restore(unsigned int flags);
+uint64_t rdmsr(uint32_t msr);
+void wrmsr(uint32_t msr, uint64_t val);
+uint64_t rdtsc(void);
 
 
 
@@ -55,6 +62,8 @@ void irq_uninstall_handler(int irq);
 // System clock headers
 void timer_install();
 extern void sleep(int ms);
+extern void usleep(unsigned long us);
+extern void nanosleep(uint64_t ns);
 
 
 
@@ -71,10 +80,4 @@ void swi_install_handler(int swi, void (* handler)(struct regs *r));
 void swi_uninstall_handler(int swi);
 void swi_install();
 
-
-
-// Memory headers
-//void vmem_init();
-//uint32_t *pd;
-
 #endif
@@ -0,0 +1,49 @@
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// A timer, embedded in whatever waits on it.
+struct timer {
+    struct timer *next;         // Next timer in the same slot or queue.
+    struct timer **pprev;       // Link to this timer, NULL when not pending.
+    unsigned long expires;      // Tick at which the timer fires.
+    unsigned long period;       // Ticks between firings, 0 if only once.
+    void (*func)(void *arg);    // Called after the timer interrupt.
+    void *arg;
+};
+
+extern volatile unsigned long tick_count;
+
+extern unsigned long timer_ticks(void);
+extern void	timer_init(struct timer *t, void (*func)(void *), void *arg);
+extern void	timer_arm(struct timer *t, unsigned long expires);
+extern void	timer_add(struct timer *t, unsigned long deadline,
+    void (*func)(void *), void *arg);
+extern void	timer_add_periodic(struct timer *t, unsigned long deadline,
+    unsigned long period, void (*func)(void *), void *arg);
+extern bool	timer_cancel(struct timer *t);
+extern bool	timer_pending(struct timer *t);
+extern void	timer_run_ready(void);
+extern uint64_t	clock_ns(void);
+
+
+// Ticks per second.
+#define TIMER_HZ        1000
+
+// True if tick "a" is at or after tick "b", even across a wrap.
+#define TICK_AFTER_EQ(a, b)     ((long)((a) - (b)) >= 0)
+
+/*
+ * The wheel has a first level of 2^TVR_BITS one-tick slots and
+ * TVN_LEVELS levels of 2^TVN_BITS slots, each slot of a level spanning a
+ * whole turn of the level below.  Together they cover 32 bits of ticks.
+ */
+#define TVR_BITS        8
+#define TVN_BITS        6
+#define TVN_LEVELS      4
+#define TVR_SIZE        (1 << TVR_BITS)
+#define TVN_SIZE        (1 << TVN_BITS)
+
+#endif //KERNEL_TIMER_H
@@ -0,0 +1,84 @@
+#ifndef __VMEMORY_H
+#define __VMEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern void	vmem_init(uintptr_t mem_top);
+extern int	map_page(uintptr_t virt, uintptr_t phys, uint32_t flags);
+extern void	unmap_page(uintptr_t virt);
+extern int	map_range(uintptr_t virt, uintptr_t phys, size_t size,
+		    uint32_t flags);
+extern void	unmap_range(uintptr_t virt, size_t size);
+extern int	protect_range(uintptr_t virt, size_t size, uint32_t flags);
+extern int	vmem_reserve(uintptr_t start, size_t size, uint32_t flags);
+extern void	vmem_release(uintptr_t start, uintptr_t end);
+extern int	vmem_fault(uintptr_t addr, uint32_t err);
+extern uint32_t	*vmem_clone(void);
+extern void	vmem_free(uint32_t *dir);
+extern void	vmem_switch(uint32_t *dir);
+extern int	vmem_set_cache(uintptr_t virt, size_t size, uint32_t cache);
+extern uint32_t	*vmem_pde(uintptr_t virt);
+extern uint32_t	*vmem_pte(uintptr_t virt);
+extern uintptr_t vmem_translate(uintptr_t virt);
+
+
+// Page directory and page table entry bits.
+#define PG_PRESENT      (1 << 0)
+#define PG_WRITE        (1 << 1)
+#define PG_USER         (1 << 2)
+#define PG_PWT          (1 << 3)
+#define PG_PCD          (1 << 4)
+#define PG_ACCESSED     (1 << 5)
+#define PG_DIRTY        (1 << 6)
+#define PG_PSE          (1 << 7)        // 4 MiB page, directory entries only.
+#define PG_GLOBAL       (1 << 8)
+#define PG_COW          (1 << 9)        // Available bit: copy on write.
+#define PG_PAT          (1 << 7)        // Page table entries only.
+
+/*
+ * Memory types of a page, selecting entries of the Page Attribute Table as
+ * programmed by vmem_init().  Without PAT, PG_WC means write-through.
+ */
+#define PG_WB           0
+#define PG_WC           PG_PWT
+#define PG_UC           (PG_PCD | PG_PWT)
+#define PG_CACHE        (PG_PAT | PG_PCD | PG_PWT)
+
+#define PG_FRAME        0xFFFFF000      // Frame address in a 4 KiB entry.
+#define PG_LARGE_FRAME  0xFFC00000      // Frame address in a 4 MiB entry.
+
+#define LARGE_PAGE_SIZE (1 << 22)
+
+// Page fault error code bits.
+#define PF_PRESENT      (1 << 0)        // Page was present.
+#define PF_WRITE        (1 << 1)        // Fault was a write.
+#define PF_USER         (1 << 2)        // Fault happened in user mode.
+
+// Directory and table index of a virtual address.
+#define PD_INDEX(virt)  ((uint32_t)(virt) >> 22)
+#define PT_INDEX(virt)  (((uint32_t)(virt) >> 12) & 0x3FF)
+
+// Directory slot that maps the page directory onto itself.
+#define PD_RECURSIVE    1023
+
+/*
+ * Through the recursive slot the current page tables appear at PT_WINDOW
+ * (0xFFC00000) and the current directory at PD_WINDOW (0xFFFFF000).
+ */
+#define PT_WINDOW       ((uintptr_t)PD_RECURSIVE << 22)
+#define PD_WINDOW       (PT_WINDOW + ((uintptr_t)PD_RECURSIVE << 12))
+
+// Page table, page table entry and directory entry mapping a virtual address.
+#define PT_VADDR(virt)  ((uint32_t *)(PT_WINDOW + (PD_INDEX(virt) << 12)))
+#define PTE_VADDR(virt) ((uint32_t *)(PT_WINDOW + ((uint32_t)(virt) >> 12) * 4))
+#define PDE_VADDR(virt) ((uint32_t *)(PD_WINDOW + PD_INDEX(virt) * 4))
+
+// Largest number of pages invalidated one by one after a change to a
+// range; more than that flush the whole TLB.
+#define TLB_FLUSH_THRESHOLD     32
+
+// Most demand paged regions vmem_reserve() keeps track of.
+#define VM_MAX_REGIONS  8
+
+#endif //KERNEL_VMEMORY_H
@@ -1,5 +1,7 @@
 
 #include <system.h>
+#include <stdbool.h>
+#include <timer.h>
 
 
 #define PIC1		0x20		/* IO base address for master PIC */
@@ -35,6 +37,9 @@ void *irq_routines[16] = {
     0, 0, 0, 0, 0, 0, 0, 0
 };
 
+// Set while deferred work runs, so interrupts taken meanwhile leave it be.
+static bool in_deferred;
+
 void
 irq_install_handler(int irq, void (* handler)(struct regs *r))
 {
@@ -113,6 +118,19 @@ irq_handler(struct regs *r)
 
         // Notify master controller.
         outportb(PIC1_COMMAND, PIC_EOI);
+
+        /*
+         * Run the work deferred by handlers, such as timer callbacks, with
+         * interrupts enabled.  An interrupt taken while it runs returns
+         * straight to it instead of starting it again.
+         */
+        if (!in_deferred) {
+                in_deferred = true;
+                ENABLE_INT;
+                timer_run_ready();
+                BLOCK_INT;
+                in_deferred = false;
+        }
 }
 
 
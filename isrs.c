@@ -1,4 +1,6 @@
 #include <system.h>
+#include <stdint.h>
+#include <vmemory.h>
 
 /* Function prototypes for all of the exception handlers. */
 extern void isr0();
@@ -113,15 +115,30 @@ char *exception_messages[] =
     };
 
 /*
- * Handler for all ISR's, currently just prints error message
- * to screen if interrupt is one of the 32 reserved interrupts.
+ * Handler for all ISR's.  Page faults in demand paged memory are resolved,
+ * otherwise prints error message to screen if interrupt is one of the 32
+ * reserved interrupts.
  */
 void fault_handler(struct regs *r)
 {
+        uint32_t addr = 0;
+
+        if (r->int_no == 14) {
+                /* CR2 holds the address that caused the page fault. */
+                __asm__ __volatile__("movl %%cr2, %0" : "=r" (addr));
+                if (vmem_fault(addr, r->err_code) == 0)
+                        return;
+        }
+
         if (r->int_no < 32) {
                 /* Display the description for the Exception that occurred. */
                 puts(exception_messages[r->int_no]);
                 puts(" Exception. System Halted!\n");
+                if (r->int_no == 14) {
+                        puts("Faulting address: ");
+                        putnum(addr);
+                        putch('\n');
+                }
                 for (;;);
         }
 }
@@ -171,11 +171,8 @@ echo_line()
 void
 keyboard_init()
 {
-        for (int i = 0; i < 256; i ++)
-                key_states[i] = 0;
-
-        for (int i = 0; i < 32; i ++)
-                command_queue[i] = 0;
+        memset(key_states, 0, sizeof(key_states));
+        memset(command_queue, 0, sizeof(command_queue));
 
         line_buffer = malloc(sizeof(char) * 100);
 
@@ -1,52 +1,93 @@
 #include <system.h>
 #include <malloc.h>
+#include <memlib.h>
+#include <frame.h>
+#include <buddy.h>
+#include <arena.h>
+#include <vmemory.h>
+#include <string.h>
+#include <cpu.h>
+#include <multiboot.h>
+
+// Demand paged window the heap grows through, above the identity map.
+#define HEAP_BASE               0xE0000000
+#define HEAP_MAX_SIZE           (1 << 28)
 
 extern char *line_buffer;
 
-void *
-memcpy(void *dest, const void *src, size_t count)
+// Assembly -- Reads from input port
+unsigned char
+inportb(unsigned short _port)
 {
-        const char *sp = (const char *)src;
-        char *dp = (char *)dest;
-        for(; count != 0; count--) *dp++ = *sp++;
-        return dest;
+        unsigned char rv;
+        __asm__ __volatile__("inb %1, %0" : "=a" (rv) : "dN" (_port));
+        return rv;
 }
 
-void *
-memset(void *dest, char val, size_t count)
+// Assembly -- Writes to output port
+void
+outportb(unsigned short _port, unsigned char _data)
 {
-        char *temp = (char *)dest;
-        for( ; count != 0; count--) *temp++ = val;
-        return dest;
+        __asm__ __volatile__("outb %1, %0" : : "dN" (_port), "a" (_data));
 }
 
-unsigned short *
-memsetw(unsigned short *dest, unsigned short val, size_t count)
+// Assembly -- Saves EFLAGS and disables interrupts
+unsigned int
+irq_save(void)
 {
-        unsigned short *temp = (unsigned short *)dest;
-        for( ; count != 0; count--) *temp++ = val;
-        return dest;
+        unsigned int flags;
+        __asm__ __volatile__("pushfl; popl %0; cli" : "=r" (flags)
+            : : "memory");
+        return flags;
 }
 
-// Assembly -- Reads from input port
-unsigned char
-inportb(unsigned short _port)
+// Assembly -- Restores the interrupt flag saved by irq_save()
+void
+irq_restore(unsigned int flags)
 {
-        unsigned char rv;
-        __asm__ __volatile__("inb %1, %0" : "=a" (rv) : "dN" (_port));
+        __asm__ __volatile__("pushl %0; popfl" : : "r" (flags)
+            : "memory", "cc");
+}
+
+// Assembly -- Reads a model specific register
+uint64_t
+rdmsr(uint32_t msr)
+{
+        uint64_t rv;
+        __asm__ __volatile__("rdmsr" : "=A" (rv) : "c" (msr));
         return rv;
 }
 
-// Assembly -- Writes to output port
+// Assembly -- Writes a model specific register
 void
-outportb(unsigned short _port, unsigned char _data)
+wrmsr(uint32_t msr, uint64_t val)
 {
-        __asm__ __volatile__("outb %1, %0" : : "dN" (_port), "a" (_data));
+        __asm__ __volatile__("wrmsr" : : "c" (msr), "A" (val));
+}
+
+// Assembly -- Reads the time stamp counter
+uint64_t
+rdtsc(void)
+{
+        uint64_t rv;
+        __asm__ __volatile__("rdtsc" : "=A" (rv));
+        return rv;
 }
 
 int
-main()
+main(unsigned int magic, struct multiboot_info *mbi)
 {
+        uintptr_t mem_top;
+        arena_t scratch;
+        arena_mark_t mark;
+        const char *msg;
+        char *text;
+
+        // Find the CPU's features and patch in the code that suits it,
+        // before anything large is copied.
+        cpu_init();
+        string_init();
+
         // Setup the GDT.
         gdt_install();
 
@@ -61,6 +102,22 @@ main()
 
         swi_install();
 
+        // Find the RAM from the boot loader's memory map.
+        if (magic != MULTIBOOT_BOOTLOADER_MAGIC)
+                mbi = NULL;
+        frame_init(mbi, HEAP_BASE);
+        mem_top = frame_mem_top();
+
+        // Contiguous runs come from buddy blocks, taken from the frames as
+        // they are needed.
+        buddy_init(mem_top);
+
+        // Identity map the memory and turn on paging.
+        vmem_init(mem_top);
+
+        // The heap takes frames only as it touches its window.
+        vmem_reserve(HEAP_BASE, HEAP_MAX_SIZE, PG_GLOBAL | PG_WRITE);
+        mem_init(HEAP_BASE, HEAP_BASE + HEAP_MAX_SIZE);
         heap_init();
 
         // Begin the system timer.
@@ -72,17 +129,26 @@ main()
 
         // Setup the screen output and print to screen.
         init_video();
+#ifdef SCRN_BENCH
+        scrn_bench();
+#endif
         puts("Hello World!\n");
 
-        char *text = malloc(50);
-        text = "abcdefghijklmnopqrstuvwxyz\n";
-        puts(text);
-        free(text);
+        // Format transient text in a scratch arena, released in one step.
+        arena_init(&scratch);
+        mark = arena_save(&scratch);
+        msg = "abcdefghijklmnopqrstuvwxyz\n";
+        if ((text = arena_alloc(&scratch, strlen(msg) + 1)) != NULL) {
+                memcpy(text, msg, strlen(msg) + 1);
+                puts(text);
+        }
+        arena_restore(&scratch, mark);
 
 
 
-        // Infinite loop.
-        for (;;);
+        // Sleep until there is something to do.
+        for (;;)
+                cpu_idle();
 //        {
 //                // Line received
 //                while (line_buffer[0] == '\0');
@@ -1,13 +1,29 @@
-
-
 /*
- * Simple, 32-bit and 64-bit clean allocator based on an implicit free list,
- * first fit placement, and boundary tag coalescing, as described in the
- * CS:APP3e text.  Blocks are aligned to double-word boundaries.  This
- * yields 8-byte aligned blocks on a 32-bit processor, and 16-byte aligned
- * blocks on a 64-bit processor.  However, 16-byte alignment is stricter
- * than necessary; the assignment only requires 8-byte alignment.  The
- * minimum block size is four words.
+ * Simple, 32-bit and 64-bit clean allocator based on segregated explicit
+ * free lists, power-of-two size classes, and boundary tag coalescing, as
+ * described in the CS:APP3e text.  Blocks are aligned to 8 byte boundaries.
+ * The minimum block size is MIN_SIZE bytes, which leaves room for the
+ * header, footer, and the two free list pointers.
+ *
+ * Free blocks are kept in one doubly linked list per size class.  Class i
+ * holds blocks whose size lies in [2^(i + MIN_CLASS), 2^(i + MIN_CLASS + 1)),
+ * with the last class also holding everything larger.  A bitmap of the
+ * non-empty classes lets find_fit() pick a class with a single bit scan, so
+ * the cost of an allocation does not depend on how many blocks are live.
+ *
+ * The heap starts small and is grown through mem_sbrk() whenever no free
+ * block fits.  When freeing leaves a large free block at the end of the
+ * heap, the whole chunks at its end are given back with a negative
+ * mem_sbrk().
+ *
+ * Small blocks are cached in per-CPU magazines in front of the heap: one
+ * short stack of recently freed blocks per exact block size.  malloc() and
+ * free() of a small block pop or push a magazine with a single
+ * compare-and-swap, which is atomic with respect to interrupts on the local
+ * CPU, so the hot path needs neither a lock nor interrupt masking.  Only
+ * when a magazine runs empty or full is the heap itself locked, and blocks
+ * then move between the two in batches.  Blocks in a magazine stay marked
+ * as allocated in their boundary tags.
  *
  * This allocator uses the size of a pointer, e.g., sizeof(void *), to
  * define the size of a word.  This allocator also uses the standard
@@ -19,6 +35,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <memlib.h>
 
 
 /* Basic constants and macros: */
@@ -27,6 +44,9 @@
 #define DSIZE      (2 * WSIZE)    /* Doubleword size (bytes) */
 #define CHUNKSIZE  (1 << 12)      /* Extend heap by this amount (bytes) */
 
+/* Trim the heap when its last free block reaches this size (bytes). */
+#define TRIM_THRESHOLD  (1 << 16)
+
 #define MAX(x, y)  ((x) > (y) ? (x) : (y))
 
 /* Pack a size and allocated bit into a word. */
@@ -56,21 +76,103 @@
 #define MAX_CLASS	20
 #define MAX_SIZE	(1 << MAX_CLASS)
 
+// Round a size up to a whole number of chunks.
+#define CHUNK_ROUND(size)  (((size) + CHUNKSIZE - 1) & ~(size_t)(CHUNKSIZE - 1))
+
+// Adjust a request size to include overhead and alignment reqs.
+#define ADJUST_SIZE(size)						\
+	((size) + DSIZE <= MIN_SIZE ? MIN_SIZE :			\
+	    ALIGN * (((size) + DSIZE + (ALIGN - 1)) / ALIGN))
+
+// Number of segregated free lists.
+#define NUM_BINS	(MAX_CLASS - MIN_CLASS + 1)
+
+// Largest block size cached in magazines, and blocks held by each one.
+#define MAG_MAX_SIZE	256
+#define MAG_CLASSES	((MAG_MAX_SIZE - MIN_SIZE) / ALIGN + 1)
+#define MAG_ROUNDS	16
+
+// Blocks moved between a magazine and the heap at once.
+#define MAG_BATCH	(MAG_ROUNDS / 2)
+
+// This CPU's magazine for blocks of "asize" bytes.
+#define MAGAZINE(asize)							\
+	(&magazines[smp_processor_id()][((asize) - MIN_SIZE) / ALIGN])
+
 
 // Macro to determine size class from size.
-// This is the fastest available command (5 instructions)
-// As the Xeon processors in CLEAR do no support clz or ctz instructions.
+// __builtin_clz() is a single bsr, which every x86 since the 386 has, so
+// no CPU check or patched variant is needed.
 #define GET_BIN(c)	(32u - __builtin_clz(c))
 
 
+// Free blocks store their list links in the first two payload words.
+typedef struct Node {
+    struct Node *prev;
+    struct Node *next;
+} node_t;
+
+// Sentinels for each free list, stored at the start of the heap.
+typedef struct Header {
+    node_t heads[NUM_BINS];
+    uint32_t nonempty;          // Bit i set if heads[i] is non-empty.
+} header_t;
+
+/*
+ * Magazine state, updated as one 64-bit word.  The generation is bumped on
+ * every change, so that a pop or push interrupted by another one on the
+ * same CPU fails its compare-and-swap and retries.
+ */
+typedef union MagState {
+    uint64_t word;
+    struct {
+        uint32_t rounds;        // Number of blocks held.
+        uint32_t gen;           // Generation count.
+    };
+} mag_state_t;
+
+typedef struct Magazine {
+    mag_state_t state;
+    void *rounds[MAG_ROUNDS];
+} magazine_t;
+
+
 /* Global variables: */
 static char *heap_listp; /* Pointer to first block */
+static header_t *head;   /* Free list sentinels */
+static char *heap_end;   /* Pointer to the epilogue block */
+
+/* Per-CPU caches of small blocks. */
+static magazine_t magazines[NR_CPUS][MAG_CLASSES];
+
+/* Call counters reported by heap_get_stats(). */
+static unsigned long malloc_calls, free_calls, realloc_calls, failed_allocs;
 
 /* Function prototypes for internal helper routines: */
+static void *heap_alloc(size_t asize);
+static void heap_free(void *bp);
 static void *coalesce(void *bp);
-//static void *extend_heap(size_t words);
+static void *extend_heap(size_t size);
+static void *grow_heap(size_t asize);
+static void trim_heap(void *bp);
 static void *find_fit(size_t asize);
+static void *find_aligned_fit(size_t asize, size_t align, char **payload);
 static void place(void *bp, size_t asize);
+static void split(void *bp, size_t asize);
+
+static void insert_node(node_t *node);
+static void remove_node(node_t *node);
+
+static void *mag_pop(magazine_t *mag);
+static bool mag_push(magazine_t *mag, void *bp);
+static void *mag_refill(magazine_t *mag, size_t asize);
+static void mag_drain(magazine_t *mag, void *bp);
+
+static void heap_stats_handler(struct regs *r);
+
+#if NUM_BINS != HEAP_STAT_CLASSES
+#error "HEAP_STAT_CLASSES must match the number of free lists"
+#endif
 
 
 /* 
@@ -84,21 +186,54 @@ static void place(void *bp, size_t asize);
 int
 heap_init(void)
 {
+        unsigned int i;
 
         /* Create the initial empty heap. */
-        heap_listp = heap;
+        if ((head = mem_sbrk(sizeof(header_t) + 3 * WSIZE + ALIGN)) ==
+            (void *)-1)
+                return (-1);
+
+        /* Free list sentinels live at the very start of the heap. */
+        for (i = 0; i < NUM_BINS; i++) {
+                head->heads[i].next = &head->heads[i];
+                head->heads[i].prev = &head->heads[i];
+        }
+        head->nonempty = 0;
+
+        /* Start with empty magazines. */
+        memset(magazines, 0, sizeof(magazines));
+
+        /*
+         * Place the prologue so that the payload of every following block
+         * is ALIGN aligned.
+         */
+        heap_listp = (char *)head + sizeof(header_t) + WSIZE;
+        heap_listp += (ALIGN - (uintptr_t)heap_listp % ALIGN) % ALIGN;
 
-	PUT(heap_listp, 0);                            /* Alignment padding */
-        PUT(heap_listp + (1 * WSIZE), PACK(ALIGN, 1)); /* Prologue header */
-        PUT(heap_listp + (2 * WSIZE), PACK(ALIGN, 1)); /* Prologue footer */
+        PUT(HDRP(heap_listp), PACK(DSIZE, 1));          /* Prologue header */
+        PUT(FTRP(heap_listp), PACK(DSIZE, 1));          /* Prologue footer */
 
-        char *fblock = heap_listp + 2 * WSIZE;
-        size_t bsize = ALIGN * ((HEAP_SIZE - 3 * WSIZE) / ALIGN);
-        PUT(HDRP(fblock), bsize);
-        PUT(FTRP(fblock), bsize);
+        /*
+         * Pad the break so that it stays chunk aligned, and make the padding
+         * the first free block.
+         */
+        heap_end = (char *)mem_heap_hi() + 1;
+        if (mem_sbrk(CHUNK_ROUND((uintptr_t)heap_end) -
+            (uintptr_t)heap_end) == (void *)-1)
+                return (-1);
 
-        PUT(HDRP(NEXT_BLKP(fblock)), PACK(0, 1));     /* Epilogue header */
-        heap_listp += (2 * WSIZE);
+        char *fblock = heap_listp + DSIZE;
+        heap_end = (char *)mem_heap_hi() + 1;
+        PUT(HDRP(fblock), PACK(heap_end - fblock, 0));
+        PUT(FTRP(fblock), PACK(heap_end - fblock, 0));
+        PUT(HDRP(heap_end), PACK(0, 1));                /* Epilogue header */
+        insert_node((node_t *)fblock);
+
+        /* Extend the empty heap with a free block of HEAP_INIT_SIZE bytes. */
+        if (extend_heap(HEAP_INIT_SIZE) == NULL)
+                return (-1);
+
+        swi_install_handler(SWI_HEAP_STATS, heap_stats_handler);
 
         return (0);
 }
@@ -116,25 +251,29 @@ void *
 malloc(size_t size)
 {
         size_t asize;      /* Adjusted block size */
+        unsigned int flags;
         void *bp;
 
+        malloc_calls++;
+
         /* Ignore spurious requests. */
         if (size == 0)
                 return (NULL);
 
         /* Adjust block size to include overhead and alignment reqs. */
-        if (size <= ALIGN)
-                asize = DSIZE + ALIGN;
-        else
-                asize = ALIGN * ((size + DSIZE + (ALIGN - 1)) / ALIGN);
+        asize = ADJUST_SIZE(size);
 
-        /* Search the free list for a fit. */
-        if ((bp = find_fit(asize)) != NULL) {
-                place(bp, asize);
-                return (bp);
+        /* Small blocks come from this CPU's magazine. */
+        if (asize <= MAG_MAX_SIZE) {
+                if ((bp = mag_pop(MAGAZINE(asize))) != NULL)
+                        return (bp);
+                return (mag_refill(MAGAZINE(asize), asize));
         }
-        return NULL;
 
+        flags = irq_save();
+        bp = heap_alloc(asize);
+        irq_restore(flags);
+        return (bp);
 }
 
 /* 
@@ -147,17 +286,24 @@ malloc(size_t size)
 void
 free(void *bp)
 {
-        size_t size;
+        unsigned int flags;
+
+        free_calls++;
 
         /* Ignore spurious requests. */
         if (bp == NULL)
                 return;
 
-        /* Free and coalesce the block. */
-        size = GET_SIZE(HDRP(bp));
-        PUT(HDRP(bp), PACK(size, 0));
-        PUT(FTRP(bp), PACK(size, 0));
-        coalesce(bp);
+        /* Small blocks go back to this CPU's magazine. */
+        if (GET_SIZE(HDRP(bp)) <= MAG_MAX_SIZE) {
+                if (!mag_push(MAGAZINE(GET_SIZE(HDRP(bp))), bp))
+                        mag_drain(MAGAZINE(GET_SIZE(HDRP(bp))), bp);
+                return;
+        }
+
+        flags = irq_save();
+        heap_free(bp);
+        irq_restore(flags);
 }
 
 /*
@@ -167,17 +313,21 @@ free(void *bp)
  * Effects:
  *   Reallocates the block "ptr" to a block with at least "size" bytes of
  *   payload, unless "size" is zero.  If "size" is zero, frees the block
- *   "ptr" and returns NULL.  If the block "ptr" is already a block with at
- *   least "size" bytes of payload, then "ptr" may optionally be returned.
- *   Otherwise, a new block is allocated and the contents of the old block
- *   "ptr" are copied to that new block.  Returns the address of this new
- *   block if the allocation was successful and NULL otherwise.
+ *   "ptr" and returns NULL.  A smaller request shrinks "ptr" in place and
+ *   frees the tail, and a larger one grows "ptr" in place by absorbing a
+ *   free successor when that is enough.  Otherwise, a new block is
+ *   allocated and the contents of the old block "ptr" are copied to that
+ *   new block.  Returns the address of the resulting block if the
+ *   allocation was successful and NULL otherwise.
  */
 void *
 realloc(void *ptr, size_t size)
 {
-        size_t oldsize;
-        void *newptr;
+        size_t oldsize, asize, nsize;
+        unsigned int flags;
+        void *newptr, *next;
+
+        realloc_calls++;
 
         /* If size == 0 then this is just free, and we return NULL. */
         if (size == 0) {
@@ -189,6 +339,35 @@ realloc(void *ptr, size_t size)
         if (ptr == NULL)
                 return (malloc(size));
 
+        asize = ADJUST_SIZE(size);
+        oldsize = GET_SIZE(HDRP(ptr));
+
+        flags = irq_save();
+
+        /* Shrink in place, giving back the tail if it can form a block. */
+        if (asize <= oldsize) {
+                split(ptr, asize);
+                irq_restore(flags);
+                return (ptr);
+        }
+
+        /* Grow in place if the next block is free and large enough. */
+        next = NEXT_BLKP(ptr);
+        if (next == heap_end &&
+            extend_heap(CHUNK_ROUND(asize - oldsize)) != NULL)
+                next = NEXT_BLKP(ptr);
+        if (!GET_ALLOC(HDRP(next)) &&
+            (nsize = oldsize + GET_SIZE(HDRP(next))) >= asize) {
+                remove_node((node_t *)next);
+                PUT(HDRP(ptr), PACK(nsize, 1));
+                PUT(FTRP(ptr), PACK(nsize, 1));
+                split(ptr, asize);
+                irq_restore(flags);
+                return (ptr);
+        }
+
+        irq_restore(flags);
+
         newptr = malloc(size);
 
         /* If realloc() fails the original block is left untouched  */
@@ -196,10 +375,7 @@ realloc(void *ptr, size_t size)
                 return (NULL);
 
         /* Copy the old data. */
-        oldsize = GET_SIZE(HDRP(ptr));
-        if (size < oldsize)
-                oldsize = size;
-        memcpy(newptr, ptr, oldsize);
+        memcpy(newptr, ptr, oldsize - DSIZE);
 
         /* Free the old block. */
         free(ptr);
@@ -207,17 +383,255 @@ realloc(void *ptr, size_t size)
         return (newptr);
 }
 
+/*
+ * Requires:
+ *   "align" is a power of two.
+ *
+ * Effects:
+ *   Allocate a block with at least "size" bytes of payload whose address is
+ *   a multiple of "align", unless "size" is zero.  The slack in front of the
+ *   aligned payload is split off and returned to the free lists.  Returns
+ *   the address of this block if the allocation was successful and NULL
+ *   otherwise.
+ */
+void *
+memalign(size_t align, size_t size)
+{
+        size_t asize, csize, gap;
+        unsigned int flags;
+        char *bp, *p;
+
+        /* Every block is already ALIGN aligned. */
+        if (align <= ALIGN)
+                return (malloc(size));
+
+        malloc_calls++;
+
+        /* Ignore spurious requests. */
+        if (size == 0 || (align & (align - 1)) != 0)
+                return (NULL);
+
+        asize = ADJUST_SIZE(size);
+
+        flags = irq_save();
+        if ((bp = find_aligned_fit(asize, align, &p)) == NULL) {
+                /* Get enough memory to place the block at any alignment. */
+                if (grow_heap(asize + align + MIN_SIZE) == NULL ||
+                    (bp = find_aligned_fit(asize, align, &p)) == NULL) {
+                        irq_restore(flags);
+                        failed_allocs++;
+                        return (NULL);
+                }
+        }
+
+        /* Return the leading slack to the free lists. */
+        if (p != bp) {
+                csize = GET_SIZE(HDRP(bp));
+                gap = p - bp;
+
+                PUT(HDRP(bp), PACK(gap, 0));
+                PUT(FTRP(bp), PACK(gap, 0));
+                insert_node((node_t *)bp);
+
+                PUT(HDRP(p), PACK(csize - gap, 0));
+                PUT(FTRP(p), PACK(csize - gap, 0));
+        }
+
+        place(p, asize);
+        irq_restore(flags);
+        return (p);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Allocate "n" contiguous, page aligned pages.  Returns the address of the
+ *   first page or NULL if the allocation failed.  The pages are released
+ *   with free().
+ */
+void *
+alloc_pages(size_t n)
+{
+        return (memalign(PAGE_SIZE, n * PAGE_SIZE));
+}
+
+/*
+ * Requires:
+ *   "stats" is not NULL.
+ *
+ * Effects:
+ *   Fill "stats" with a snapshot of the heap.  The byte and block counts
+ *   are computed here by walking the heap and the free lists, so keeping
+ *   them costs nothing until somebody asks.
+ */
+void
+heap_get_stats(struct heap_stats *stats)
+{
+        node_t *bp, *list;
+        char *blk;
+        size_t size;
+        unsigned int flags, i, j, k;
+
+        flags = irq_save();
+
+        stats->heap_size = mem_heapsize();
+        stats->bytes_allocated = 0;
+        stats->bytes_free = 0;
+        stats->allocated_blocks = 0;
+        stats->largest_free = 0;
+
+        for (blk = NEXT_BLKP(heap_listp); blk != heap_end;
+            blk = NEXT_BLKP(blk)) {
+                size = GET_SIZE(HDRP(blk));
+                if (GET_ALLOC(HDRP(blk))) {
+                        stats->bytes_allocated += size;
+                        stats->allocated_blocks++;
+                } else {
+                        stats->bytes_free += size;
+                        if (size > stats->largest_free)
+                                stats->largest_free = size;
+                }
+        }
+
+        for (i = 0; i < NUM_BINS; i++) {
+                stats->free_blocks[i] = 0;
+                list = &head->heads[i];
+                for (bp = list->next; bp != list; bp = bp->next)
+                        stats->free_blocks[i]++;
+        }
+
+        /* Blocks cached in magazines are allocated in the heap's view. */
+        stats->bytes_cached = 0;
+        for (i = 0; i < NR_CPUS; i++) {
+                for (j = 0; j < MAG_CLASSES; j++) {
+                        for (k = 0; k < magazines[i][j].state.rounds; k++) {
+                                size = GET_SIZE(HDRP(
+                                    magazines[i][j].rounds[k]));
+                                stats->bytes_cached += size;
+                                stats->bytes_allocated -= size;
+                                stats->allocated_blocks--;
+                        }
+                }
+        }
+
+        irq_restore(flags);
+
+        stats->malloc_calls = malloc_calls;
+        stats->free_calls = free_calls;
+        stats->realloc_calls = realloc_calls;
+        stats->failed_allocs = failed_allocs;
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Print a snapshot of the heap on the console.
+ */
+void
+heap_print_stats(void)
+{
+        struct heap_stats stats;
+        unsigned int i;
+
+        heap_get_stats(&stats);
+
+        puts("Heap size: ");
+        putnum(stats.heap_size);
+        puts("\nAllocated: ");
+        putnum(stats.bytes_allocated);
+        puts(" bytes in ");
+        putnum(stats.allocated_blocks);
+        puts(" blocks\nFree: ");
+        putnum(stats.bytes_free);
+        puts(" bytes, largest block ");
+        putnum(stats.largest_free);
+        puts("\nCached: ");
+        putnum(stats.bytes_cached);
+        puts(" bytes");
+        puts("\nFree blocks per class:");
+        for (i = 0; i < HEAP_STAT_CLASSES; i++) {
+                putch(' ');
+                putnum(stats.free_blocks[i]);
+        }
+        puts("\nCalls: malloc ");
+        putnum(stats.malloc_calls);
+        puts(", free ");
+        putnum(stats.free_calls);
+        puts(", realloc ");
+        putnum(stats.realloc_calls);
+        puts(", failed ");
+        putnum(stats.failed_allocs);
+        putch('\n');
+}
+
 /*
  * The following routines are internal helper routines.
  */
 
 /*
  * Requires:
- *   "bp" is the address of a newly freed block.
+ *   "asize" is an adjusted block size.  Interrupts are disabled.
+ *
+ * Effects:
+ *   Allocate a block of "asize" bytes from the heap itself, growing it if
+ *   necessary.  Returns the address of the block or NULL if the heap could
+ *   not be extended.
+ */
+static void *
+heap_alloc(size_t asize)
+{
+        void *bp;
+
+        /* Search the free lists for a fit. */
+        if ((bp = find_fit(asize)) != NULL) {
+                place(bp, asize);
+                return (bp);
+        }
+
+        /* No fit found.  Get more memory and place the block. */
+        if ((bp = grow_heap(asize)) == NULL) {
+                failed_allocs++;
+                return (NULL);
+        }
+        remove_node(bp);
+        place(bp, asize);
+        return (bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block.  Interrupts are disabled.
+ *
+ * Effects:
+ *   Free and coalesce the block, and give back memory at the end of the
+ *   heap if enough of it is free.
+ */
+static void
+heap_free(void *bp)
+{
+        size_t size;
+
+        size = GET_SIZE(HDRP(bp));
+        PUT(HDRP(bp), PACK(size, 0));
+        PUT(FTRP(bp), PACK(size, 0));
+        bp = coalesce(bp);
+
+        if (NEXT_BLKP(bp) == heap_end && GET_SIZE(HDRP(bp)) >= TRIM_THRESHOLD)
+                trim_heap(bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of a newly freed block that is not in any free list.
  *
  * Effects:
- *   Perform boundary tag coalescing.  Returns the address of the coalesced
- *   block.
+ *   Perform boundary tag coalescing, unlinking any free neighbours from
+ *   their free lists, and insert the result into the appropriate free list.
+ *   Returns the address of the coalesced block.
  */
 static void *
 coalesce(void *bp)
@@ -227,155 +641,473 @@ coalesce(void *bp)
         bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
 
         if (prev_alloc && next_alloc) {                 /* Case 1 */
-                return (bp);
+                /* Nothing to merge. */
         } else if (prev_alloc && !next_alloc) {         /* Case 2 */
+                remove_node((node_t *)NEXT_BLKP(bp));
                 size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
                 PUT(HDRP(bp), PACK(size, 0));
                 PUT(FTRP(bp), PACK(size, 0));
         } else if (!prev_alloc && next_alloc) {         /* Case 3 */
+                remove_node((node_t *)PREV_BLKP(bp));
                 size += GET_SIZE(HDRP(PREV_BLKP(bp)));
                 PUT(FTRP(bp), PACK(size, 0));
                 PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
                 bp = PREV_BLKP(bp);
         } else {                                        /* Case 4 */
+                remove_node((node_t *)PREV_BLKP(bp));
+                remove_node((node_t *)NEXT_BLKP(bp));
                 size += GET_SIZE(HDRP(PREV_BLKP(bp))) +
                         GET_SIZE(FTRP(NEXT_BLKP(bp)));
                 PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
                 PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
                 bp = PREV_BLKP(bp);
         }
+
+        insert_node((node_t *)bp);
         return (bp);
 }
 
+/*
+ * Requires:
+ *   "size" is a multiple of CHUNKSIZE.
+ *
+ * Effects:
+ *   Extend the heap by "size" bytes, coalesce the new free block with a
+ *   free last block and put it into the free lists.  Returns the address of
+ *   the coalesced block or NULL if the heap could not be extended.
+ */
+static void *
+extend_heap(size_t size)
+{
+        char *bp;
+
+        if ((bp = mem_sbrk(size)) == (void *)-1)
+                return (NULL);
+
+        /* The old epilogue header becomes the new block's header. */
+        PUT(HDRP(bp), PACK(size, 0));           /* Free block header */
+        PUT(FTRP(bp), PACK(size, 0));           /* Free block footer */
+        heap_end = NEXT_BLKP(bp);
+        PUT(HDRP(heap_end), PACK(0, 1));        /* New epilogue header */
+
+        return (coalesce(bp));
+}
+
+/*
+ * Requires:
+ *   No free block of at least "asize" bytes exists.
+ *
+ * Effects:
+ *   Extend the heap so that its last block is a free block of at least
+ *   "asize" bytes, reusing a free block already at the end of the heap.
+ *   Returns the address of that block, which is in the free lists, or NULL
+ *   if the heap could not be extended.
+ */
+static void *
+grow_heap(size_t asize)
+{
+        char *last = PREV_BLKP(heap_end);
+        size_t size = asize;
+
+        if (!GET_ALLOC(HDRP(last)) && GET_SIZE(HDRP(last)) < asize)
+                size -= GET_SIZE(HDRP(last));
+
+        return (extend_heap(CHUNK_ROUND(size)));
+}
+
+/*
+ * Requires:
+ *   "bp" is the address of the free block at the end of the heap, which is
+ *   at least TRIM_THRESHOLD bytes.
+ *
+ * Effects:
+ *   Give the whole chunks at the end of "bp" back with mem_sbrk(), keeping
+ *   one chunk so that the next small request does not grow the heap again.
+ */
+static void
+trim_heap(void *bp)
+{
+        size_t size = GET_SIZE(HDRP(bp));
+        size_t release = (size - CHUNKSIZE) & ~(size_t)(CHUNKSIZE - 1);
+
+        remove_node(bp);
+        if (mem_sbrk(-(intptr_t)release) == (void *)-1) {
+                insert_node(bp);
+                return;
+        }
+
+        PUT(HDRP(bp), PACK(size - release, 0));
+        PUT(FTRP(bp), PACK(size - release, 0));
+        insert_node(bp);
+
+        heap_end = NEXT_BLKP(bp);
+        PUT(HDRP(heap_end), PACK(0, 1));        /* New epilogue header */
+}
+
 /*
  * Requires:
  *   None.
  *
  * Effects:
- *   Find a fit for a block with "asize" bytes.  Returns that block's address
- *   or NULL if no suitable block was found. 
+ *   Find a fit for a block with "asize" bytes and remove it from its free
+ *   list.  Returns that block's address or NULL if no suitable block was
+ *   found.
  */
 static void *
 find_fit(size_t asize)
 {
-        void *bp;
+        node_t *bp, *list;
+        unsigned int bin;
+        uint32_t mask;
 
-        /* Search for the first fit. */
-        for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-                if (!GET_ALLOC(HDRP(bp)) && asize <= GET_SIZE(HDRP(bp)))
+        /*
+         * Every block in a class above the one holding "asize - 1" is large
+         * enough, so the head of the first non-empty such class is a fit.
+         */
+        bin = GET_BIN(asize - 1) - MIN_CLASS;
+        if (bin < NUM_BINS) {
+                mask = head->nonempty & (~0u << bin);
+                if (mask != 0) {
+                        bp = head->heads[__builtin_ctz(mask)].next;
+                        remove_node(bp);
                         return (bp);
+                }
+        }
+
+        /*
+         * Otherwise only blocks in the class of "asize" itself might fit,
+         * so fall back to first fit within that one list.
+         */
+        bin = GET_BIN(asize) - 1 - MIN_CLASS;
+        if (bin >= NUM_BINS)
+                bin = NUM_BINS - 1;
+
+        list = &head->heads[bin];
+        for (bp = list->next; bp != list; bp = bp->next) {
+                if (asize <= GET_SIZE(HDRP(bp))) {
+                        remove_node(bp);
+                        return (bp);
+                }
+        }
+
+        /* No fit was found. */
+        return (NULL);
+}
+
+/*
+ * Requires:
+ *   "align" is a power of two larger than ALIGN.
+ *
+ * Effects:
+ *   Find a free block that can hold a block of "asize" bytes whose payload
+ *   is a multiple of "align", and remove it from its free list.  Any gap in
+ *   front of the payload is at least the minimum block size, so that it can
+ *   be returned to the free lists.  Stores the aligned payload address in
+ *   "payload" and returns the free block's address, or NULL if no suitable
+ *   block was found.
+ */
+static void *
+find_aligned_fit(size_t asize, size_t align, char **payload)
+{
+        node_t *bp, *list;
+        unsigned int bin;
+        uint32_t mask;
+        char *p;
+
+        /*
+         * Unlike find_fit() the class alone does not guarantee a fit, so
+         * check the placement in every non-empty class that could hold it.
+         * Aligned requests are rare enough that the scan is worthwhile to
+         * avoid reserving a whole alignment's worth of padding.
+         */
+        bin = GET_BIN(asize) - 1 - MIN_CLASS;
+        if (bin >= NUM_BINS)
+                bin = NUM_BINS - 1;
+
+        for (mask = head->nonempty & (~0u << bin); mask != 0;
+            mask &= mask - 1) {
+                list = &head->heads[__builtin_ctz(mask)];
+                for (bp = list->next; bp != list; bp = bp->next) {
+                        p = (char *)(((uintptr_t)bp + align - 1) &
+                            ~(uintptr_t)(align - 1));
+                        while (p != (char *)bp &&
+                            (size_t)(p - (char *)bp) < MIN_SIZE)
+                                p += align;
+
+                        if ((size_t)(p - (char *)bp) + asize <=
+                            GET_SIZE(HDRP(bp))) {
+                                remove_node(bp);
+                                *payload = p;
+                                return (bp);
+                        }
+                }
         }
+
         /* No fit was found. */
         return (NULL);
 }
 
 /* 
  * Requires:
- *   "bp" is the address of a free block that is at least "asize" bytes.
+ *   "bp" is the address of a free block that is at least "asize" bytes and
+ *   is not in any free list.
  *
  * Effects:
  *   Place a block of "asize" bytes at the start of the free block "bp" and
  *   split that block if the remainder would be at least the minimum block
- *   size. 
+ *   size.  The remainder is put back into the appropriate free list.
  */
 static void
 place(void *bp, size_t asize)
 {
         size_t csize = GET_SIZE(HDRP(bp));
 
-        if ((csize - asize) >= (DSIZE)) {
+        if ((csize - asize) >= MIN_SIZE) {
                 PUT(HDRP(bp), PACK(asize, 1));
                 PUT(FTRP(bp), PACK(asize, 1));
                 bp = NEXT_BLKP(bp);
                 PUT(HDRP(bp), PACK(csize - asize, 0));
                 PUT(FTRP(bp), PACK(csize - asize, 0));
+                insert_node((node_t *)bp);
         } else {
                 PUT(HDRP(bp), PACK(csize, 1));
                 PUT(FTRP(bp), PACK(csize, 1));
         }
 }
 
+/*
+ * Requires:
+ *   "bp" is the address of an allocated block that is at least "asize"
+ *   bytes.
+ *
+ * Effects:
+ *   Shrink the block "bp" to "asize" bytes if the remainder would be at
+ *   least the minimum block size, freeing and coalescing the remainder.
+ */
+static void
+split(void *bp, size_t asize)
+{
+        size_t csize = GET_SIZE(HDRP(bp));
 
+        if ((csize - asize) < MIN_SIZE)
+                return;
 
+        PUT(HDRP(bp), PACK(asize, 1));
+        PUT(FTRP(bp), PACK(asize, 1));
+        bp = NEXT_BLKP(bp);
+        PUT(HDRP(bp), PACK(csize - asize, 0));
+        PUT(FTRP(bp), PACK(csize - asize, 0));
+        coalesce(bp);
+}
 
+/*
+ * Requires:
+ *   "node" is a free block with valid header and footer that is not in any
+ *   free list.
+ *
+ * Effects:
+ *   Inserts "node" at the front of the free list for its size class.
+ */
+static void
+insert_node(node_t *node)
+{
+        unsigned int bin = GET_BIN(GET_SIZE(HDRP(node))) - 1 - MIN_CLASS;
+        node_t *list;
 
+        if (bin >= NUM_BINS)
+                bin = NUM_BINS - 1;
+        list = &head->heads[bin];
 
-// TODO: Figure out why this doesn't work.
+        node->next = list->next;
+        node->prev = list;
 
-//typedef struct Node {
-//    struct Node *prev;
-//    struct Node *next;
-//}__attribute__((packed)) node_t;
-//typedef struct Header {
-//    node_t heads[MAX_CLASS - MIN_CLASS + 1];
-//}__attribute__((packed)) header_t;
-//
-//
-///* Global variables: */
-//static char *heap_listp; /* Pointer to first block */
-//static header_t *head;
-//
-//// Pointer to epilogue block, useful for fast operations at end of heap.
-//void *end;
-//
-///* Function prototypes for internal helper routines: */
-////static void *extend_heap(size_t words);
-//static void *find_fit(size_t asize);
-//static void place(void *bp, size_t asize);
-//
-///* Function prototypes for heap consistency checker routines: */
-////static void checkblock(void *bp);
-////static void checkheap(bool verbose);
-////static void printblock(void *bp);
-//
-//
-//static void insert_node(node_t *new, node_t *list);
-//static void remove_node(node_t *node);
-//
-///*
-// * Requires:
-// *   None.
-// *
-// * Effects:
-// *   Initialize the memory manager.  Returns 0 if the memory manager was
-// *   successfully initialized and -1 otherwise.
-// */
-//int
-//heap_init(void)
+        list->next = node;
+        node->next->prev = node;
+
+        head->nonempty |= 1u << bin;
+}
+
+/*
+ * Requires:
+ *   "node" is a member of the free list for the size class recorded in its
+ *   header.
+ *
+ * Effects:
+ *   Removes "node" from the list containing "node".
+ */
+static void
+remove_node(node_t *node)
+{
+        node->next->prev = node->prev;
+        node->prev->next = node->next;
+
+        /* Clear the class bit if the list became empty. */
+        if (node->next == node->prev) {
+                unsigned int bin = GET_BIN(GET_SIZE(HDRP(node))) -
+                    1 - MIN_CLASS;
+
+                if (bin >= NUM_BINS)
+                        bin = NUM_BINS - 1;
+                head->nonempty &= ~(1u << bin);
+        }
+}
+
+
+
+/*
+ * Requires:
+ *   "mag" is a magazine of the current CPU.
+ *
+ * Effects:
+ *   Take the most recently cached block out of "mag".  Returns its address
+ *   or NULL if the magazine is empty.
+ */
+static void *
+mag_pop(magazine_t *mag)
+{
+        mag_state_t old, new;
+        void *bp;
+
+        do {
+                /* A torn read only makes the compare-and-swap fail. */
+                old.word = *(volatile uint64_t *)&mag->state.word;
+                if (old.rounds == 0)
+                        return (NULL);
+                bp = mag->rounds[old.rounds - 1];
+                new.rounds = old.rounds - 1;
+                new.gen = old.gen + 1;
+        } while (!__sync_bool_compare_and_swap(&mag->state.word, old.word,
+            new.word));
+
+        return (bp);
+}
+
+/*
+ * Requires:
+ *   "mag" is a magazine of the current CPU and "bp" an allocated block of
+ *   its size.
+ *
+ * Effects:
+ *   Cache "bp" in "mag".  Returns false if the magazine is full.
+ */
+static bool
+mag_push(magazine_t *mag, void *bp)
+{
+        mag_state_t old, new;
+
+        do {
+                old.word = *(volatile uint64_t *)&mag->state.word;
+                if (old.rounds == MAG_ROUNDS)
+                        return (false);
+                /*
+                 * The slot above the top is unused; whoever interrupts us
+                 * here and reuses it also bumps the generation.
+                 */
+                mag->rounds[old.rounds] = bp;
+                new.rounds = old.rounds + 1;
+                new.gen = old.gen + 1;
+        } while (!__sync_bool_compare_and_swap(&mag->state.word, old.word,
+            new.word));
+
+        return (true);
+}
+
+/*
+ * Requires:
+ *   "mag" is the current CPU's magazine for blocks of "asize" bytes.
+ *
+ * Effects:
+ *   Allocate a block of "asize" bytes from the heap, together with up to
+ *   MAG_BATCH more that are cached in "mag".  Returns the address of the
+ *   block or NULL if the heap could not be extended.
+ */
+static void *
+mag_refill(magazine_t *mag, size_t asize)
+{
+        unsigned int flags, i;
+        void *bp, *extra;
+
+        flags = irq_save();
+        if ((bp = heap_alloc(asize)) != NULL) {
+                for (i = 0; i < MAG_BATCH; i++) {
+                        if ((extra = find_fit(asize)) == NULL)
+                                break;
+                        place(extra, asize);
+                        if (!mag_push(mag, extra)) {
+                                heap_free(extra);
+                                break;
+                        }
+                }
+        }
+        irq_restore(flags);
+
+        return (bp);
+}
+
+/*
+ * Requires:
+ *   "mag" is the current CPU's magazine for blocks of the size of "bp".
+ *
+ * Effects:
+ *   Free "bp" when "mag" is full: give MAG_BATCH cached blocks back to the
+ *   heap and cache "bp" in the room made.
+ */
+static void
+mag_drain(magazine_t *mag, void *bp)
+{
+        unsigned int flags, i;
+        void *old;
+
+        flags = irq_save();
+        for (i = 0; i < MAG_BATCH; i++) {
+                if ((old = mag_pop(mag)) == NULL)
+                        break;
+                heap_free(old);
+        }
+        if (!mag_push(mag, bp))
+                heap_free(bp);
+        irq_restore(flags);
+}
+
+/*
+ * Requires:
+ *   "r" holds the registers of the SWI_HEAP_STATS software interrupt.
+ *
+ * Effects:
+ *   Copy a heap snapshot to the struct heap_stats pointed to by EBX, or
+ *   print it on the console if EBX is zero.
+ */
+static void
+heap_stats_handler(struct regs *r)
+{
+        if (r->ebx != 0)
+                heap_get_stats((struct heap_stats *)(uintptr_t)r->ebx);
+        else
+                heap_print_stats();
+}
+
+
+/*
+ * The remaining routines are heap consistency checker routines.
+ */
+
+/*
+ * Requires:
+ *   "bp" is the address of a block.
+ *
+ * Effects:
+ *   Perform a minimal check on the block "bp".
+ */
+//static void
+//checkblock(void *bp)
 //{
-//
-//        /* Create the initial empty heap. */
-//        heap_listp = (char *)heap;
-////        if ((heap_listp = mem_sbrk(3*WSIZE + sizeof(header_t))) == (void *)-1)
-////                return (-1);
-//
-//        /* Prologue header and footer */
-//        PUT(heap_listp + sizeof(header_t), PACK(DSIZE, 1));
-//        PUT(heap_listp + sizeof(header_t) + WSIZE, PACK(DSIZE, 1));
-//
-//        head = (header_t *)(heap_listp);
-//
-//        // Initialize the free lists.
-//        int i = 0;
-//        for (; i <= MAX_CLASS - MIN_CLASS; i ++) {
-//                head->heads[i].next = &head->heads[i];
-//                head->heads[i].prev = &head->heads[i];
+//        if ((uintptr_t)bp % ALIGN)
+//                printf("Error: %p is not doubleword aligned\n", bp);
+//        if (GET(HDRP(bp)) != GET(FTRP(bp)))
+//                printf("Error: header does not match footer\n");
+//        if (GET_SIZE(HDRP(bp)) < MIN_SIZE && bp != heap_listp) {
+//                printf("Error: block is too small.\n");
 //        }
-//
-//        /* Epilogue header */
-//        node_t *fblock = (node_t *)(heap_listp + 2 * WSIZE + sizeof(header_t));
-//        unsigned int bsize = (HEAP_SIZE) - 3 * WSIZE + sizeof(header_t);
-//        bsize = ALIGN * (bsize / ALIGN);
-//        PUT(HDRP(fblock), bsize);
-//        PUT(FTRP(fblock), bsize);
-//        insert_node(fblock, &head->heads[MAX_CLASS - MIN_CLASS]);
-//        
-//        end = FTRP(fblock) + DSIZE;
-//        PUT(HDRP(end), PACK(0, 1));
-//
-//        heap_listp += (WSIZE + sizeof(header_t));
-//
-//        return (0);
 //}
 //
 ///*
@@ -383,674 +1115,124 @@ place(void *bp, size_t asize)
 // *   None.
 // *
 // * Effects:
-// *   Allocate a block with at least "size" bytes of payload, unless
-// *   "size" is zero. Returns the address of this block if the allocation
-// *   was successful and NULL otherwise.
-// */
-//void *
-//malloc(size_t size)
-//{
-//        size_t asize;      /* Adjusted block size */
-//        void *bp;
-//
-//        /* Ignore spurious requests. */
-//        if (size == 0)
-//                return (NULL);
-//
-//        /* Adjust block size to include overhead and alignment reqs. */
-//        if (size + DSIZE <= MIN_SIZE)
-//                asize = MIN_SIZE;
-//        else
-//                asize = ALIGN * ((size + DSIZE + (ALIGN - 1)) / ALIGN);
-//
-//
-//        /* Search the free list for a fit. */
-//        if ((bp = find_fit(asize)) != NULL)
-//                return (bp);
-//
-//        return NULL;
-//}
-//
-///*
-// * Requires:
-// *   "bp" is either the address of an allocated block or NULL.
-// *
-// * Effects:
-// *   Free a block.
+// *   Perform a minimal check of the heap for consistency.
 // */
 //void
-//free(void *bp)
+//checkheap(bool verbose)
 //{
-//        unsigned int prev_alloc, next_alloc;
-//        /* Ignore spurious requests. */
-//        if (bp == NULL)
-//                return;
-//
-//        size_t size = GET_SIZE(HDRP(bp));
-//
-////        coalesce:
-////        prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-////        next_alloc = GET_ALLOC(NEXT_BLKP(bp) - WSIZE);
-////
-////        /*
-////         * The following cases handle coalescing.
-////         * Like find_fit below, putting the code here instead of a single
-////         * function allowed for improved granularity and better performance,
-////         * at the cost of longer and less modular code.
-////         */
-////
-////        // Case 1:
-////        // no coalescing necessary.
-////        if (prev_alloc && next_alloc)
-////                goto insert;
-////
-////        // Case 2:
-////        // Coalesce with blocks after current block until there are
-////        // no more free blocks after.
-////        if (prev_alloc && !next_alloc) {
-//////                while (!next_alloc) {
-////                        size += GET_SIZE(NEXT_BLKP(bp) - WSIZE);
-////
-////                        remove_node((node_t *) (NEXT_BLKP(bp)));
-////
-////                        PUT(HDRP(bp), size);
-////                        PUT(FTRP(bp), size);
-////
-////                        next_alloc = GET_ALLOC(NEXT_BLKP(bp) - WSIZE);
-//////                }
-////                goto insert;
-////                // Case 3:
-////                // Same as case 2, but this time for blocks preceding the
-////                // current block.
-////        } else if (!prev_alloc && next_alloc) {
-//////                while (!prev_alloc) {
-////                        size += GET_SIZE(PREV_BLKP(bp) - WSIZE);
-////
-////                        PUT(FTRP(bp), size);
-////
-////                        bp = PREV_BLKP(bp);
-////                        remove_node(bp);
-////                        PUT(HDRP(bp), size);
-////
-////                        prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-//////                }
-////                goto insert;
-////                // Case 4:
-////                // If the blocks in both directions are free, coalesce in both
-////                // directions until everything in joined. This case repeats
-////                // everything since it often becomes one of the earlier cases on
-////                // later iterations.
-////        } else {
-////                size += GET_SIZE(PREV_BLKP(bp) - WSIZE) +
-////                        GET_SIZE(FTRP(NEXT_BLKP(bp)));
-////
-////                PUT(FTRP(NEXT_BLKP(bp)), size);
-////                remove_node((node_t *)NEXT_BLKP(bp));
-////
-////                bp = PREV_BLKP(bp);
-////                PUT(HDRP(bp), size);
-////                remove_node(bp);
-////
-//////                goto coalesce;
-////        }
-////
-////        // Put the block back into the appropriate free list.
-////        insert:
-//
-//        if (size <= MAX_SIZE) {
-//                PUT(HDRP(bp), size);
-//                PUT(FTRP(bp), size);
+//        void *bp;
 //
-//                insert_node(bp, &head->heads[
-//                    GET_BIN(size + 1) - MIN_CLASS - 1]);
+//        if (verbose)
+//                printf("Scanning heap...\n");
 //
-//        } else {
-//                PUT(HDRP(bp), size);
-//                PUT(FTRP(bp), size);
+//        if (GET_SIZE(HDRP(heap_listp)) != DSIZE ||
+//            !GET_ALLOC(HDRP(heap_listp)))
+//                printf("Bad prologue header\n");
+//        checkblock(heap_listp);
 //
-//                insert_node(bp, &head->heads[MAX_CLASS - MIN_CLASS]);
+//        for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+//                if (verbose)
+//                        printblock(bp);
+//                checkblock(bp);
 //        }
 //
-//        return;
-//}
-//
-///*
-// * Requires:
-// *   "ptr" is either the address of an allocated block or NULL.
-// *
-// * Effects:
-// *   Reallocates the block "ptr" to a block with at least "size" bytes of
-// *   payload, unless "size" is zero.  If "size" is zero, frees the block
-// *   "ptr" and returns NULL.  If the block "ptr" is already a block with at
-// *   least "size" bytes of payload, then "ptr" may optionally be returned.
-// *   Otherwise, a new block is allocated and the contents of the old block
-// *   "ptr" are copied to that new block.  Returns the address of this new
-// *   block if the allocation was successful and NULL otherwise.
-// */
-//void *
-//realloc(void *ptr, size_t size)
-//{
-//        size_t oldsize, nsize;
-//        void *newptr, *optr;
+//        if (verbose)
+//                printblock(bp);
+//        if (GET_SIZE(HDRP(bp)) != 0 || !GET_ALLOC(HDRP(bp)))
+//                printf("Bad epilogue header\n");
 //
-//        /* If size == 0 then this is just free, and we return NULL. */
-//        if (size == 0) {
-//                free(ptr);
-//                return (NULL);
+//        if (verbose) {
+//                printf("Scanned heap.\n");
+//                printf("Scanning free lists...\n");
 //        }
 //
-//        /* If oldptr is NULL, then this is just malloc. */
-//        if (ptr == NULL)
-//                return (malloc(size));
-//
-//        oldsize = GET_SIZE(HDRP(ptr));
-//        size_t asize = ALIGN * ((size + DSIZE + ALIGN - 1) / ALIGN);
-//
-//        // If block was over-allocated, then no change is necessary.
-//        if (oldsize >= asize)
-//                return ptr;
-//
-//
-//        // Attempt to expand into blocks following ptr.
-//        nsize = oldsize;
-//        while (!GET_ALLOC(NEXT_BLKP(ptr) - WSIZE)) {
-//                nsize += GET_SIZE(NEXT_BLKP(ptr) - WSIZE);
-//
-//                remove_node((node_t *) NEXT_BLKP(ptr));
+//        // Check free lists:
+//        // Every block in the free lists should be free
+//        // and should be the appropriate size
+//        unsigned int i;
+//        for (i = 0; i <= MAX_CLASS - MIN_CLASS; i++) {
+//                if (verbose)
+//                        printf("Checking class %u.\n", i + MIN_CLASS);
+//
+//                bp = head->heads[i].next;
+//                while (bp != &head->heads[i]) {
+//                        if (verbose)
+//                                printblock(bp);
+//                        if (GET_ALLOC(HDRP(bp)))
+//                                printf("Allocated block in free list.\n");
+//                        if (GET_SIZE(HDRP(bp)) < (1u << (i + MIN_CLASS)))
+//                                printf("Block in wrong size class.\n");
+//                        if (((node_t *)bp)->next == NULL ||
+//                            ((node_t *)bp)->prev == NULL)
+//                                printf("Free block fields not set.\n");
+//                        bp = ((node_t *)bp)->next;
+//                }
 //
-//                PUT(HDRP(ptr), PACK(nsize, 1));
-//                PUT(FTRP(ptr), PACK(nsize, 1));
 //
-//                if (asize < nsize)
-//                        return ptr;
 //
 //        }
 //
-//        // In order to use previous, there must be a continuous free block
-//        // not including the current block, in order to preserve memory.
-//        if (!GET_ALLOC(PREV_BLKP(ptr) - WSIZE)) {
-//                optr = PREV_BLKP(ptr);
-//                size_t msize = GET_SIZE((char *) optr - WSIZE);
-//                while (!GET_ALLOC(PREV_BLKP(optr) - WSIZE)) {
-//                        msize += GET_SIZE(PREV_BLKP(optr) - WSIZE);
-//
-//                        remove_node((node_t *) PREV_BLKP(optr));
-//                        PUT(FTRP(optr), PACK(msize, 1));
-//                        optr = PREV_BLKP(optr);
-//                        PUT(HDRP(optr), PACK(msize, 1));
-//
-//                        if (msize >= asize) {
-//                                if (size < oldsize)
-//                                        oldsize = size;
-//                                memcpy(optr, ptr, oldsize);
-//                                free(ptr);
-//                                return optr;
-//                        }
-//                }
+//        if (verbose) {
+//                printf("Scanned free lists.\n");
+//                printf("Checking for isolated free blocks...\n");
 //        }
 //
-//        // Attempt to place in an existing free block.
-//        // This does not bother splitting any block it does fine, so it is
-//        // potentially wasteful.
-//        unsigned int i;
-//        for (i = GET_BIN(asize) - MIN_CLASS; i < MAX_CLASS - MIN_CLASS; i++) {
-//                if (head->heads[i].next != &head->heads[i]) {
-//                        node_t *b = head->heads[i].next;
-//
-//                        remove_node(b);
-//
-//                        *HDRP(b) |= 1;
-//                        *FTRP(b) |= 1;
-//
-//                        if (size < oldsize)
-//                                oldsize = size;
-//                        memcpy(b, ptr, oldsize);
-//                        free(ptr);
-//                        return b;
+//        // Check that all free blocks are stored in the correct free list.
+//        bool found;
+//        node_t *bp2;
+//        for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+//                if (GET_ALLOC(HDRP(bp)))
+//                        continue;
+//
+//                i = GET_BIN(GET_SIZE(HDRP(bp)));
+//                if (i > MAX_CLASS)
+//                        i = MAX_CLASS + 1;
+//
+//                found = false;
+//                bp2 = head->heads[i - MIN_CLASS - 1].next;
+//                while (bp2 != &head->heads[i - MIN_CLASS - 1]) {
+//                        if (bp2 == bp) {
+//                                found = true;
+//                                break;
+//                        }
+//                        bp2 = bp2->next;
 //                }
-//        }
-//
-//        // If the current block is at the end of the heap, simply expand the
-//        // heap to meet the new memory requirement.
-////        if (NEXT_BLKP(ptr) == end) {
-////                void *b;
-////                if ((b = mem_sbrk(asize - nsize)) == (void *) -1)
-////                        return (NULL);
-////
-////                b = (node_t *)PREV_BLKP(b);
-////                PUT(HDRP(b), PACK(asize, 1));
-////                PUT(FTRP(b), PACK(asize, 1));
-////                PUT(NEXT_BLKP(b) - WSIZE, 1);
-////
-////                end = NEXT_BLKP(b);
-////        }
-//
-//        // If all the above methods fail, then just allocate a new block.
-//        newptr = malloc(size);
-//
-//        /* If realloc() fails the original block is left untouched  */
-//        if (newptr == NULL)
-//                return (NULL);
-//
-//        /* Copy the old data. */
-//        if (size < oldsize)
-//                oldsize = size;
-//        memcpy(newptr, ptr, oldsize);
-//
-//        /* Free the old block. */
-//        free(ptr);
-//
-//        return (newptr);
-//}
-//
-///*
-// * The following routines are internal helper routines.
-// */
-//
-///*
-// * Requires:
-// *   None.
-// *
-// * Effects:
-// *   Extend the heap with a free block and return that block's address.
-// */
-////static void *
-////extend_heap(size_t words)
-////{
-////        size_t size;
-////        void *bp;
-////
-////        size = words * ALIGN;
-////        if ((bp = mem_sbrk(size)) == (void *)-1)
-////                return (NULL);
-////
-////        /* Initialize free block header/footer and the epilogue header. */
-////        PUT(HDRP(bp), size);         /* Free block header */
-////        PUT(FTRP(bp), size);         /* Free block footer */
-////        PUT(NEXT_BLKP(bp) - WSIZE, 1); /* New epilogue header */
-////        end = NEXT_BLKP(bp);
-////
-////        return (bp);
-////}
 //
-///*
-// * Requires:
-// *   None.
-// *
-// * Effects:
-// *   Find a fit for a block with "asize" bytes. If no suitable fit is found,
-// *   then the heap is extended to create a suitable block. After finding the
-// *   block, the block is marked as allocated, and a pointer to the block is
-// *   returned. If no suitable block was found, and no block could be created,
-// *   returns NULL.
-// *
-// */
-//static void *
-//find_fit(size_t asize)
-//{
-//        node_t *bp;//, *b;
-//        unsigned int i;//, prev_alloc;
-////        size_t psize;
+//                if (!found)
+//                        printf("Error: Free block not in free list\n");
 //
-//        // Search the existing free blocks for any which are large enough.
-//        // If one is found, place it and return the pointer.
-//        for (i = GET_BIN(asize) - MIN_CLASS;
-//             i <= MAX_CLASS - MIN_CLASS; i++) {
-//                if (head->heads[i].next != &head->heads[i]) {
-//                        bp = head->heads[i].next;
-//                        remove_node(bp);
-//                        place(bp, asize);
-//                        return bp;
-//                }
 //        }
 //
-//        /*
-//         * If no existing block is large enough, then we will need to get
-//         * more memory.
-//         * The following code is long and fairly repetitive, however the
-//         * various cases tested here produce fairly significant performance
-//         * improvements, so the complex code is the cost for improved
-//         * performance.
-//         * That said we have added comments to explain the cases.
-//         */
-//
-//        
-//        // No way to extend heap, this is just an error.
-//        // If the last block in the heap is free, we don't need to
-//        // extend the heap by as much.
-////        prev_alloc = GET_ALLOC(HDRP(PREV_BLKP(end)));
-////        if (!prev_alloc) {
-////                remove_node((node_t *)PREV_BLKP(end));
-////                psize = GET_SIZE(HDRP(PREV_BLKP(end)));
-////
-////                /*
-////                 * This is a case that shouldn't really happen, but can due to
-////                 * the way blocks are replaced in the free lists.
-////                 * i.e. A block with 56 bytes will be placed in the 32 byte
-////                 * size class. Thus, it's possible that no heap extension is
-////                 * necessary after all.
-////                 */
-////                if (psize >= asize) {
-////                        b = (node_t *) PREV_BLKP(end);
-////
-////                        // Mark the block as allocated and recycle the excess
-////                        // if large enough.
-////                        if (psize - asize >= MIN_SIZE) {
-////                                PUT(HDRP(b), PACK(asize, 1));
-////                                PUT(FTRP(b), PACK(asize, 1));
-////
-////                                // Set headers for excess.
-////                                PUT(NEXT_BLKP(b) - WSIZE, psize - asize);
-////                                PUT(FTRP(NEXT_BLKP(b)), psize - asize);
-////
-////                                if (psize - asize < MAX_SIZE) {
-////                                        i = GET_BIN(psize - asize);
-////                                        insert_node(
-////                                            (node_t *) NEXT_BLKP(b),
-////                                            &head->heads[i - 1 - MIN_CLASS]);
-////
-////                                } else
-////                                        insert_node(
-////                                            (node_t *) NEXT_BLKP(b),
-////                                            &head->heads[MAX_CLASS - MIN_CLASS]
-////                                        );
-////
-////                        } else {        // Excess is too small to recycle.
-////                                PUT(HDRP(b), PACK(psize, 1));
-////                                PUT(FTRP(b), PACK(psize, 1));
-////                        }
-////                } else {
-////                        /*
-////                         * Extend the heap so the two blocks joined meet
-////                         * the requested size. In this case, there will be no
-////                         * excess, so no reason to check for excess.
-////                         */
-////                        if ((b = mem_sbrk(asize - psize)) == (void *) -1)
-////                                return (NULL);
-////
-////                        b = (node_t *)PREV_BLKP(b);
-////                        PUT(HDRP(b), PACK(asize, 1));
-////                        PUT(FTRP(b), PACK(asize, 1));
-////                        PUT(NEXT_BLKP(b) - WSIZE, 1);
-////
-////                        end = NEXT_BLKP(b);
-////                }
-////        } else {
-////                /*
-////                 * If the last block is allocated, then extend the heap to
-////                 * make a new block. For blocks larger than CHUNKSIZE, simply
-////                 * extend by the size of the block. For smaller blocks, it's
-////                 * more efficient to allocate a page, then split off the
-////                 * excess and store the resultant free blocks for later
-////                 * requests.
-////                 */
-////                if (asize > CHUNKSIZE ) {
-////                        if ((b = mem_sbrk(asize)) == (void *) -1)
-////                                return (NULL);
-////
-////                        PUT(HDRP(b), PACK(asize, 1));
-////                        PUT(FTRP(b), PACK(asize, 1));
-////                        PUT(NEXT_BLKP(b) - WSIZE, 1);
-////
-////                        end = NEXT_BLKP(b);
-////                } else {
-////                        // Retrieve a full page.
-////                        b = extend_heap(CHUNKSIZE / WSIZE);
-////
-////                        // Split the page and store the excess free block if
-////                        // the block size is small enough.
-////                        if (CHUNKSIZE - asize >= MIN_SIZE) {
-////                                PUT(HDRP(b), PACK(asize, 1));
-////                                PUT(FTRP(b), PACK(asize, 1));
-////
-////                                PUT(NEXT_BLKP(b) - WSIZE, CHUNKSIZE - asize);
-////                                PUT(FTRP(NEXT_BLKP(b)), CHUNKSIZE - asize);
-////
-////                                if (CHUNKSIZE - asize < MAX_SIZE) {
-////                                        i = GET_BIN(CHUNKSIZE - asize);
-////                                        insert_node((node_t *)NEXT_BLKP(b),
-////                                                    &head->heads[
-////                                                        (i - 1 - MIN_CLASS)]);
-////                                } else
-////                                        insert_node(
-////                                            (node_t *)NEXT_BLKP(b),
-////                                            &head->heads[MAX_CLASS - MIN_CLASS]
-////                                        );
-////                        } else {
-////                                PUT(HDRP(b), PACK(CHUNKSIZE, 1));
-////                                PUT(FTRP(b), PACK(CHUNKSIZE, 1));
-////                        }
-////                }
-////        }
-////        return b;
+//        if (verbose)
+//                printf("All checks complete\n");
 //
-//        return NULL;
 //}
 //
 ///*
 // * Requires:
-// *   "bp" is the address of a free block that is at least "asize" bytes.
+// *   "bp" is the address of a block.
 // *
 // * Effects:
-// *   Place a block of "asize" bytes at the start of the free block "bp" and
-// *   split that block if the remainder would be at least the minimum block
-// *   size.
+// *   Print the block "bp".
 // */
 //static void
-//place(void *bp, size_t asize)
+//printblock(void *bp)
 //{
-//        // Subtracting here, then adding later if necessary, reduces the
-//        // overall operation count slightly.
-//        size_t csize = GET_SIZE(HDRP(bp)) - asize;
-//
-//        // Free block is large enough to split
-//        if (csize >= MIN_SIZE) {
-//
-//                PUT(HDRP(bp), PACK(asize, 1));
-//                PUT(FTRP(bp), PACK(asize, 1));
-//
-//                // We know the size, so no reason to get size.
-//                bp = NEXT_BLKP(bp);
+//        size_t hsize, fsize;
+//        bool halloc, falloc;
 //
-//                // Set the header and footer for the excess block.
-//                PUT(HDRP(bp), csize);
-//                PUT(FTRP(bp), csize);
+//        checkheap(false);
+//        hsize = GET_SIZE(HDRP(bp));
+//        halloc = GET_ALLOC(HDRP(bp));
+//        fsize = GET_SIZE(FTRP(bp));
+//        falloc = GET_ALLOC(FTRP(bp));
 //
-//                // Put the excess back into the correct free list.
-//                if (csize <= MAX_SIZE)
-//                        insert_node(bp, &head->heads[
-//                            GET_BIN(csize) - MIN_CLASS - 1]);
-//                else
-//                        insert_node(bp, &head->heads[MAX_CLASS - MIN_CLASS]);
-//
-//        } else {
-//                // Set the headers, no further action required.
-//                PUT(HDRP(bp), PACK(csize + asize, 1));
-//                PUT((char *)bp + (csize + asize) - DSIZE,
-//                    PACK(csize + asize, 1));
+//        if (hsize == 0) {
+//                printf("%p: end of heap\n", bp);
+//                return;
 //        }
-//}
 //
-///*
-// * Requires:
-// *   An node_t struct representing an existing doubly linked list, with
-// *   appropriate (non-null, pointing to valid node_t structs) next and prev
-// *   pointers, and a node_t struct to be inserted.
-// *
-// * Effects:
-// *   Inserts the node_t "new" into the list containing "list".
-// */
-//static void
-//insert_node(node_t *new, node_t *list)
-//{
-//        new->next = list->next;
-//        new->prev = list;
-//
-//        list->next = new;
-//        new->next->prev = new;
-//}
-//
-///*
-// * Requires:
-// *   A node_t struct which is a member of a valid node list.
-// *
-// * Effects:
-// *   Removes "node" from the list containing "node".
-// */
-//static void
-//remove_node(node_t *node)
-//{
-//        node->next->prev = node->prev;
-//        node->prev->next = node->next;
+//        printf("%p: header: [%zu:%c] footer: [%zu:%c]\n", bp,
+//               hsize, (halloc ? 'a' : 'f'),
+//               fsize, (falloc ? 'a' : 'f'));
 //}
-//
-//
-///*
-// * The remaining routines are heap consistency checker routines.
-// */
-//
-///*
-// * Requires:
-// *   "bp" is the address of a block.
-// *
-// * Effects:
-// *   Perform a minimal check on the block "bp".
-// */
-////static void
-////checkblock(void *bp)
-////{
-////        if ((uintptr_t)bp % ALIGN)
-////                printf("Error: %p is not doubleword aligned\n", bp);
-////        if (GET(HDRP(bp)) != GET(FTRP(bp)))
-////                printf("Error: header does not match footer\n");
-////        if (GET_SIZE(HDRP(bp)) < MIN_SIZE && bp != heap_listp) {
-////                printf("Error: block is too small.\n");
-////        }
-////}
-////
-/////*
-//// * Requires:
-//// *   None.
-//// *
-//// * Effects:
-//// *   Perform a minimal check of the heap for consistency.
-//// */
-////void
-////checkheap(bool verbose)
-////{
-////        void *bp;
-////
-////        if (verbose)
-////                printf("Scanning heap...\n");
-////
-////        if (GET_SIZE(HDRP(heap_listp)) != DSIZE ||
-////            !GET_ALLOC(HDRP(heap_listp)))
-////                printf("Bad prologue header\n");
-////        checkblock(heap_listp);
-////
-////        for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-////                if (verbose)
-////                        printblock(bp);
-////                checkblock(bp);
-////        }
-////
-////        if (verbose)
-////                printblock(bp);
-////        if (GET_SIZE(HDRP(bp)) != 0 || !GET_ALLOC(HDRP(bp)))
-////                printf("Bad epilogue header\n");
-////
-////        if (verbose) {
-////                printf("Scanned heap.\n");
-////                printf("Scanning free lists...\n");
-////        }
-////
-////        // Check free lists:
-////        // Every block in the free lists should be free
-////        // and should be the appropriate size
-////        unsigned int i;
-////        for (i = 0; i <= MAX_CLASS - MIN_CLASS; i++) {
-////                if (verbose)
-////                        printf("Checking class %u.\n", i + MIN_CLASS);
-////
-////                bp = head->heads[i].next;
-////                while (bp != &head->heads[i]) {
-////                        if (verbose)
-////                                printblock(bp);
-////                        if (GET_ALLOC(HDRP(bp)))
-////                                printf("Allocated block in free list.\n");
-////                        if (GET_SIZE(HDRP(bp)) < (1u << (i + MIN_CLASS)))
-////                                printf("Block in wrong size class.\n");
-////                        if (((node_t *)bp)->next == NULL ||
-////                            ((node_t *)bp)->prev == NULL)
-////                                printf("Free block fields not set.\n");
-////                        bp = ((node_t *)bp)->next;
-////                }
-////
-////
-////
-////        }
-////
-////        if (verbose) {
-////                printf("Scanned free lists.\n");
-////                printf("Checking for isolated free blocks...\n");
-////        }
-////
-////        // Check that all free blocks are stored in the correct free list.
-////        bool found;
-////        node_t *bp2;
-////        for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-////                if (GET_ALLOC(HDRP(bp)))
-////                        continue;
-////
-////                i = GET_BIN(GET_SIZE(HDRP(bp)));
-////                if (i > MAX_CLASS)
-////                        i = MAX_CLASS + 1;
-////
-////                found = false;
-////                bp2 = head->heads[i - MIN_CLASS - 1].next;
-////                while (bp2 != &head->heads[i - MIN_CLASS - 1]) {
-////                        if (bp2 == bp) {
-////                                found = true;
-////                                break;
-////                        }
-////                        bp2 = bp2->next;
-////                }
-////
-////                if (!found)
-////                        printf("Error: Free block not in free list\n");
-////
-////        }
-////
-////        if (verbose)
-////                printf("All checks complete\n");
-////
-////}
-////
-/////*
-//// * Requires:
-//// *   "bp" is the address of a block.
-//// *
-//// * Effects:
-//// *   Print the block "bp".
-//// */
-////static void
-////printblock(void *bp)
-////{
-////        size_t hsize, fsize;
-////        bool halloc, falloc;
-////
-////        checkheap(false);
-////        hsize = GET_SIZE(HDRP(bp));
-////        halloc = GET_ALLOC(HDRP(bp));
-////        fsize = GET_SIZE(FTRP(bp));
-////        falloc = GET_ALLOC(FTRP(bp));
-////
-////        if (hsize == 0) {
-////                printf("%p: end of heap\n", bp);
-////                return;
-////        }
-////
-////        printf("%p: header: [%zu:%c] footer: [%zu:%c]\n", bp,
-////               hsize, (halloc ? 'a' : 'f'),
-////               fsize, (falloc ? 'a' : 'f'));
-////}
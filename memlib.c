@@ -0,0 +1,106 @@
+/*
+ * Break management for the kernel heap, in the style of the CS:APP memlib
+ * package.  The heap grows on demand through a window of virtual memory
+ * given to mem_init().
+ *
+ * The window is demand paged, so growing the break only moves it: a page
+ * is backed by a frame when the heap first touches it.  Shrinking the
+ * break hands the frames behind the trailing pages back to the page frame
+ * allocator, so that they can be used for something other than the heap.
+ */
+
+#include <system.h>
+#include <memlib.h>
+#include <vmemory.h>
+
+
+#define PAGE_ALIGN(x)   (((x) + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1))
+
+
+static char *mem_start_brk;     // First byte of the heap.
+static char *mem_brk;           // First byte past the heap.
+static char *mem_max_addr;      // First byte past the window.
+
+
+/*
+ * Requires:
+ *   [mem_start, mem_top) is a demand paged region of virtual memory.
+ *
+ * Effects:
+ *   Initialize an empty heap that may grow through [mem_start, mem_top).
+ */
+void
+mem_init(uintptr_t mem_start, uintptr_t mem_top)
+{
+        mem_start_brk = (char *)PAGE_ALIGN(mem_start);
+        mem_brk = mem_start_brk;
+        mem_max_addr = (char *)(mem_top & ~(uintptr_t)(PAGE_SIZE - 1));
+        if (mem_max_addr < mem_start_brk)
+                mem_max_addr = mem_start_brk;
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Move the break by "incr" bytes, growing the heap if "incr" is positive
+ *   and shrinking it if "incr" is negative.  Returns the old break, or
+ *   (void *)-1 if the heap cannot be moved that far.
+ */
+void *
+mem_sbrk(intptr_t incr)
+{
+        char *old_brk = mem_brk;
+
+        if (incr > mem_max_addr - mem_brk || -incr > mem_brk - mem_start_brk)
+                return ((void *)-1);
+
+        mem_brk += incr;
+
+        // Give back the frames of the whole pages past the new break.
+        if (incr < 0)
+                vmem_release(PAGE_ALIGN((uintptr_t)mem_brk),
+                    PAGE_ALIGN((uintptr_t)old_brk));
+
+        return (old_brk);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the address of the first heap byte.
+ */
+void *
+mem_heap_lo(void)
+{
+        return (mem_start_brk);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the address of the last heap byte.
+ */
+void *
+mem_heap_hi(void)
+{
+        return (mem_brk - 1);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the size of the heap in bytes.
+ */
+size_t
+mem_heapsize(void)
+{
+        return (mem_brk - mem_start_brk);
+}
@@ -0,0 +1,193 @@
+/*
+ * Object caches for fixed-size kernel objects.
+ *
+ * Each cache carves pages obtained from alloc_pages() into equal
+ * sized objects and keeps every free object on a single per-cache free
+ * list, so allocating and freeing an object is a pointer pop or push with
+ * no per-object header.  Slabs are only returned to the heap when the
+ * cache is destroyed.
+ *
+ * If a constructor is given it is run once on each object when its slab is
+ * carved, and objects are expected to be freed back in their constructed
+ * state.  The free list link is then kept in an extra word after the object
+ * so that it does not clobber constructed data.  Caches without a
+ * constructor store the link in the first word of the free object.
+ */
+
+#include <system.h>
+#include <stdint.h>
+#include <slab.h>
+
+
+struct slab {
+    struct slab *next;
+};
+
+struct kmem_cache {
+    const char *name;
+    size_t size;                // Object size as requested.
+    size_t align;               // Alignment of each object.
+    size_t stride;              // Distance between objects in a slab.
+    size_t link;                // Offset of the free list link in an object.
+    unsigned int per_slab;      // Objects carved from each slab.
+    void (*ctor)(void *);
+    void *freelist;             // Free objects, linked through "link".
+    struct slab *slabs;         // All slabs owned by this cache.
+};
+
+
+#define ALIGN_UP(x, a)          (((x) + (a) - 1) & ~((a) - 1))
+#define MAX(x, y)               ((x) > (y) ? (x) : (y))
+
+#define LINK(cache, obj)        (*(void **)((char *)(obj) + (cache)->link))
+
+
+static int grow(kmem_cache_t *cache);
+
+
+/*
+ * Requires:
+ *   "align" is zero or a power of two no larger than SLAB_SIZE.
+ *
+ * Effects:
+ *   Create a cache of "size" byte objects aligned to "align" bytes (or to
+ *   the machine word if "align" is zero), optionally constructed by
+ *   "ctor".  Returns the cache or NULL if it could not be created.
+ */
+kmem_cache_t *
+kmem_cache_create(const char *name, size_t size, size_t align,
+    void (*ctor)(void *))
+{
+        kmem_cache_t *cache;
+
+        if (size == 0)
+                return (NULL);
+        if (align < sizeof(void *))
+                align = sizeof(void *);
+
+        if ((cache = malloc(sizeof(kmem_cache_t))) == NULL)
+                return (NULL);
+
+        cache->name = name;
+        cache->size = size;
+        cache->ctor = ctor;
+        cache->freelist = NULL;
+        cache->slabs = NULL;
+
+        // Keep the link out of the way of constructed objects.
+        if (ctor != NULL) {
+                cache->link = ALIGN_UP(size, sizeof(void *));
+                cache->stride = ALIGN_UP(cache->link + sizeof(void *), align);
+        } else {
+                cache->link = 0;
+                cache->stride = ALIGN_UP(MAX(size, sizeof(void *)), align);
+        }
+
+        // The first object follows the slab header at the next alignment.
+        cache->align = align;
+        if (ALIGN_UP(sizeof(struct slab), align) + cache->stride > SLAB_SIZE) {
+                free(cache);
+                return (NULL);
+        }
+        cache->per_slab = (SLAB_SIZE - ALIGN_UP(sizeof(struct slab), align)) /
+            cache->stride;
+
+        return (cache);
+}
+
+/*
+ * Requires:
+ *   "cache" was returned by kmem_cache_create() and every object allocated
+ *   from it has been freed.
+ *
+ * Effects:
+ *   Release every slab owned by "cache" and the cache itself.
+ */
+void
+kmem_cache_destroy(kmem_cache_t *cache)
+{
+        struct slab *s, *next;
+
+        if (cache == NULL)
+                return;
+
+        for (s = cache->slabs; s != NULL; s = next) {
+                next = s->next;
+                free(s);
+        }
+        free(cache);
+}
+
+/*
+ * Requires:
+ *   "cache" was returned by kmem_cache_create().
+ *
+ * Effects:
+ *   Allocate an object from "cache", carving a new slab if no free object
+ *   is available.  Returns the object or NULL if the heap is exhausted.
+ */
+void *
+kmem_cache_alloc(kmem_cache_t *cache)
+{
+        void *obj;
+
+        if (cache->freelist == NULL && grow(cache) != 0)
+                return (NULL);
+
+        obj = cache->freelist;
+        cache->freelist = LINK(cache, obj);
+        return (obj);
+}
+
+/*
+ * Requires:
+ *   "obj" is NULL or was allocated from "cache" and not yet freed.
+ *
+ * Effects:
+ *   Return "obj" to the free list of "cache".
+ */
+void
+kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+        if (obj == NULL)
+                return;
+
+        LINK(cache, obj) = cache->freelist;
+        cache->freelist = obj;
+}
+
+/*
+ * Requires:
+ *   "cache" was returned by kmem_cache_create().
+ *
+ * Effects:
+ *   Carve a new slab into objects, constructing each one if the cache has
+ *   a constructor, and push them onto the free list.  Returns 0 on success
+ *   and -1 if the heap is exhausted.
+ */
+static int
+grow(kmem_cache_t *cache)
+{
+        struct slab *s;
+        char *obj;
+        unsigned int i;
+
+        if ((s = alloc_pages(1)) == NULL)
+                return (-1);
+
+        s->next = cache->slabs;
+        cache->slabs = s;
+
+        obj = (char *)ALIGN_UP((uintptr_t)(s + 1), cache->align);
+
+        // Push in reverse so objects are handed out in address order.
+        obj += (cache->per_slab - 1) * cache->stride;
+        for (i = 0; i < cache->per_slab; i++, obj -= cache->stride) {
+                if (cache->ctor != NULL)
+                        cache->ctor(obj);
+                LINK(cache, obj) = cache->freelist;
+                cache->freelist = obj;
+        }
+
+        return (0);
+}
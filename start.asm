@@ -30,6 +30,8 @@ mboot:
 
 run:
     	extern main
+    	push ebx			; Multiboot information structure.
+    	push eax			; Multiboot magic value.
     	call main
     	cli
 .hang:
@@ -292,8 +294,11 @@ extern fault_handler
 
 ; Common handler for all interupts. It saves the processor state, sets
 ; up for kernel mode segments, calls the C-level fault handler,
-; and finally restores the stack frame.
+; and finally restores the stack frame.  The interrupted code may have
+; had the direction flag set (memmove copies backward), and C code expects
+; it clear; iret restores the old value.
 isr_common_stub:
+    cld
     pusha
     push ds
     push es
@@ -438,6 +443,7 @@ irq15:
 extern irq_handler
 
 irq_common_stub:
+	cld			; C code expects DF clear
 	pusha
 	push ds
 	push es
@@ -580,6 +586,7 @@ swi15:
 
 extern swi_handler
 swi_common_stub:
+	cld			; C code expects DF clear
 	pusha
 	push ds
 	push es
@@ -607,17 +614,21 @@ swi_common_stub:
 
 
 
-; Uncomment to enable paging
-; Setup paging
-;extern pd
-;global paging_init
-;paging_init:
-;	mov eax, [pd]					; pointer to page directory
-;	mov cr3, eax
-;	mov	eax, cr0
-;	or	eax, 0x80000001				; protected mode is required for paging
-;	mov	cr0, eax
-;	ret
+; Setup paging.  Loads the page directory built by vmem_init() and turns on
+; 4 MiB pages before enabling the MMU.  CR0.WP makes read-only pages fault on
+; kernel writes too, which copy-on-write relies on.
+extern pd
+global paging_init
+paging_init:
+	mov	eax, cr4
+	or	eax, 0x00000010				; CR4.PSE: allow 4 MiB pages
+	mov	cr4, eax
+	mov eax, [pd]					; pointer to page directory
+	mov cr3, eax
+	mov	eax, cr0
+	or	eax, 0x80010001				; protected mode is required for paging
+	mov	cr0, eax
+	ret
 
 
 SECTION .bss
@@ -625,8 +636,3 @@ SECTION .bss
 	resb 32768		; 32 KiB stack
 _sys_stack:
 	resb 32768
-
-	align 4096
-	global heap
-heap:
-	resb 1<<23		; Reserve 1 GiB of heap space
\ No newline at end of file
@@ -2,13 +2,599 @@
 // Created by Daniel on 4/3/2019.
 //
 
+/*
+ * Memory and string routines.
+ *
+ * memcpy(), memset() and memsetw() store single bytes or shorts up to a
+ * word boundary of the destination, move the bulk a word at a time with
+ * rep movsd or rep stosd, and finish the tail the same way they started.
+ * Once string_init() has patched them in on a CPU with SSE2, copies and
+ * fills at least as large as the cache a thread can count on
+ * (cpu_cache_size) instead write the bulk 64 bytes at a time with
+ * non-temporal stores.  Those would evict that cache anyway, and bypassing
+ * it leaves the rest of its contents alone.
+ * Below that size the data is likely to be used again from the cache, and
+ * rep movsd and rep stosd are faster.  The XMM registers are not saved on
+ * interrupts, so those paths disable interrupts, but only for
+ * MEM_NT_CHUNK bytes at a time.
+ */
+
+#include <system.h>
+#include <stdint.h>
 #include <string.h>
+#include <cpu.h>
+
+
+/*
+ * Words read from memory.  They may alias anything, and uword_t may also
+ * be misaligned, which the CPU allows.
+ */
+typedef uintptr_t __attribute__((__may_alias__)) word_t;
+typedef uintptr_t __attribute__((__may_alias__, __aligned__(1))) uword_t;
+
+#define WSIZE           sizeof(uintptr_t)
+
+// A one in every byte, and the top bit of every byte.
+#define ONES            ((uintptr_t)-1 / 0xFF)
+#define HIGHS           (ONES * 0x80)
+
+/*
+ * Nonzero if a byte of "x" is zero.  The lowest flagged byte is the first
+ * zero byte; the borrow out of it may flag higher bytes as well.
+ */
+#define HAS_ZERO(x)     (((x) - ONES) & ~(x) & HIGHS)
+
+// Shorter copies and fills are done a byte at a time.
+#define MEM_REP_THRESHOLD       64
+
+// The XMM registers can only be named as clobbers when the compiler
+// knows about them, as in host builds.
+#ifdef __SSE__
+#define XMM_CLOBBERS    , "xmm0", "xmm1", "xmm2", "xmm3"
+#else
+#define XMM_CLOBBERS
+#endif
+
+
+static void *memcpy_large(void *dest, const void *src, size_t count);
+static void *memset_large(void *dest, char val, size_t count);
+static void *memcpy_rep(void *dest, const void *src, size_t count);
+static void *memcpy_sse2(void *dest, const void *src, size_t count);
+static void *memset_rep(void *dest, char val, size_t count);
+static void *memset_sse2(void *dest, char val, size_t count);
+static void *memcpy_back(void *dest, const void *src, size_t count);
+
+
+// Copies and fills this large take the non-temporal path.
+static size_t nt_threshold = MEM_NT_THRESHOLD;
+
+
+/*
+ * Requires:
+ *   cpu_init() has run, and nothing is copying or filling memory.
+ *
+ * Effects:
+ *   Patch large copies and fills to the best implementation for this CPU,
+ *   and count those of at least cpu_cache_size bytes as large.
+ */
+void
+string_init(void)
+{
+        if (cpu_cache_size != 0)
+                nt_threshold = cpu_cache_size;
+
+        if (cpu_has(CPU_SSE2)) {
+                cpu_patch_jump(memcpy_large, memcpy_sse2);
+                cpu_patch_jump(memset_large, memset_sse2);
+        }
+}
+
+/*
+ * Requires:
+ *   [dest, dest + count) and [src, src + count) do not overlap.
+ *
+ * Effects:
+ *   Copy "count" bytes from "src" to "dest".  Returns "dest".
+ */
+void *
+memcpy(void *dest, const void *src, size_t count)
+{
+        if (count >= nt_threshold)
+                return (memcpy_large(dest, src, count));
+        return (memcpy_rep(dest, src, count));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Set "count" bytes at "dest" to "val".  Returns "dest".
+ */
+void *
+memset(void *dest, char val, size_t count)
+{
+        if (count >= nt_threshold)
+                return (memset_large(dest, val, count));
+        return (memset_rep(dest, val, count));
+}
+
+/*
+ * Requires:
+ *   "dest" is aligned to 2 bytes.
+ *
+ * Effects:
+ *   Set "count" shorts at "dest" to "val".  Returns "dest".
+ */
+unsigned short *
+memsetw(unsigned short *dest, unsigned short val, size_t count)
+{
+        unsigned short *d = dest;
+        uint32_t pattern = val | (uint32_t)val << 16;
+        size_t n;
 
+        if (count < MEM_REP_THRESHOLD / 2) {
+                for (; count != 0; count--)
+                        *d++ = val;
+                return (dest);
+        }
 
+        // Align to a word, then store two shorts at a time.
+        if ((uintptr_t)d & 2) {
+                *d++ = val;
+                count--;
+        }
+        n = count / 2;
+        __asm__ __volatile__("rep stosl" : "+D" (d), "+c" (n)
+            : "a" (pattern) : "memory");
+        if (count & 1)
+                *d = val;
+
+        return (dest);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Copy "count" bytes from "src" to "dest", which may overlap.  Returns
+ *   "dest".
+ */
+void *
+memmove(void *dest, const void *src, size_t count)
+{
+        // A forward copy only reads ahead of what it has written.
+        if ((uintptr_t)dest - (uintptr_t)src >= count)
+                return (memcpy(dest, src, count));
+        return (memcpy_back(dest, src, count));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Compare "count" bytes at "s1" and "s2" as unsigned chars.  Returns a
+ *   negative, zero or positive value as "s1" sorts before, equal to or
+ *   after "s2".
+ */
+int
+memcmp(const void *s1, const void *s2, size_t count)
+{
+        const unsigned char *p1 = s1, *p2 = s2;
+
+        // Both reads stay inside the ranges, so they need not be aligned.
+        for (; count >= WSIZE; count -= WSIZE, p1 += WSIZE, p2 += WSIZE)
+                if (*(const uword_t *)p1 != *(const uword_t *)p2)
+                        break;
+        for (; count != 0; count--, p1++, p2++)
+                if (*p1 != *p2)
+                        return (*p1 - *p2);
+
+        return (0);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the first of "count" bytes at "s" that equals "c" converted to
+ *   unsigned char, or NULL if there is none.
+ */
+void *
+memchr(const void *s, int c, size_t count)
+{
+        const unsigned char *p = s;
+        uintptr_t pattern = ONES * (unsigned char)c;
+
+        for (; count >= WSIZE; count -= WSIZE, p += WSIZE)
+                if (HAS_ZERO(*(const uword_t *)p ^ pattern))
+                        break;
+        for (; count != 0; count--, p++)
+                if (*p == (unsigned char)c)
+                        return ((void *)p);
+
+        return (NULL);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Compare the strings "s1" and "s2" as unsigned chars.  Returns a
+ *   negative, zero or positive value as "s1" sorts before, equal to or
+ *   after "s2".
+ */
+int
+strcmp(const char *s1, const char *s2)
+{
+        const unsigned char *p1 = (const unsigned char *)s1;
+        const unsigned char *p2 = (const unsigned char *)s2;
+        uintptr_t w;
+        size_t i;
+
+        for (; (uintptr_t)p1 % WSIZE != 0; p1++, p2++)
+                if (*p1 != *p2 || *p1 == '\0')
+                        return (*p1 - *p2);
+
+        /*
+         * "p1" is aligned, so its words never cross into a page past its
+         * end.  "p2" may not be; a word of it that would cross a page is
+         * compared a byte at a time instead.
+         */
+        for (;;) {
+                if ((uintptr_t)p2 % PAGE_SIZE > PAGE_SIZE - WSIZE) {
+                        for (i = 0; i < WSIZE; i++, p1++, p2++)
+                                if (*p1 != *p2 || *p1 == '\0')
+                                        return (*p1 - *p2);
+                        continue;
+                }
+                w = *(const word_t *)p1;
+                if (w != *(const uword_t *)p2 || HAS_ZERO(w))
+                        break;
+                p1 += WSIZE;
+                p2 += WSIZE;
+        }
+        for (;; p1++, p2++)
+                if (*p1 != *p2 || *p1 == '\0')
+                        return (*p1 - *p2);
+}
+
+/*
+ * Requires:
+ *   "dest" has room for "count" bytes, and does not overlap "src".
+ *
+ * Effects:
+ *   Copy the string "src" to "dest", stopping after "count" bytes, and
+ *   pad "dest" with null bytes up to "count".  Returns "dest".
+ */
+char *
+strncpy(char *dest, const char *src, size_t count)
+{
+        char *d = dest;
+        uintptr_t w;
+
+        // Words of "src" can be moved whole once both are aligned.
+        if ((uintptr_t)d % WSIZE == (uintptr_t)src % WSIZE) {
+                for (; (uintptr_t)src % WSIZE != 0; count--)
+                        if (count == 0 || (*d++ = *src++) == '\0')
+                                goto pad;
+                for (; count >= WSIZE; count -= WSIZE) {
+                        w = *(const word_t *)src;
+                        if (HAS_ZERO(w))
+                                break;
+                        *(word_t *)d = w;
+                        d += WSIZE;
+                        src += WSIZE;
+                }
+        }
+        for (; count != 0; count--)
+                if ((*d++ = *src++) == '\0')
+                        break;
+
+pad:
+        // The loops stop with "count" one past the null byte copied.
+        if (count > 1)
+                memset(d, 0, count - 1);
+        return (dest);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the first character of the string "s" that equals "c"
+ *   converted to char, which may be its null byte, or NULL if there is
+ *   none.
+ */
+char *
+strchr(const char *s, int c)
+{
+        uintptr_t pattern = ONES * (unsigned char)c, w;
+
+        for (; (uintptr_t)s % WSIZE != 0; s++) {
+                if (*s == (char)c)
+                        return ((char *)s);
+                if (*s == '\0')
+                        return (NULL);
+        }
+
+        // Stop at the word holding the character or the end of the string.
+        for (;; s += WSIZE) {
+                w = *(const word_t *)s;
+                if (HAS_ZERO(w) || HAS_ZERO(w ^ pattern))
+                        break;
+        }
+        for (;; s++) {
+                if (*s == (char)c)
+                        return ((char *)s);
+                if (*s == '\0')
+                        return (NULL);
+        }
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the length of the string "str".
+ */
 size_t
 strlen(const char *str)
 {
-        size_t retval;
-        for(retval = 0; *str != '\0'; str++) retval++;
-        return retval;
+        const char *s = str;
+        uintptr_t w;
+
+        for (; (uintptr_t)s % WSIZE != 0; s++)
+                if (*s == '\0')
+                        return (s - str);
+
+        // An aligned word never crosses into a page past the string.
+        for (;; s += WSIZE) {
+                w = HAS_ZERO(*(const word_t *)s);
+                if (w != 0)
+                        break;
+        }
+
+        // Bytes above the first null may be flagged too, but none below.
+        return (s - str + __builtin_ctzl(w) / 8);
+}
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   The ranges do not overlap.
+ *
+ * Effects:
+ *   Copy at least nt_threshold bytes.  Patched to memcpy_sse2() by
+ *   string_init() on CPUs with SSE2.
+ */
+static PATCHABLE void *
+memcpy_large(void *dest, const void *src, size_t count)
+{
+        return (memcpy_rep(dest, src, count));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Fill at least nt_threshold bytes.  Patched to memset_sse2() by
+ *   string_init() on CPUs with SSE2.
+ */
+static PATCHABLE void *
+memset_large(void *dest, char val, size_t count)
+{
+        return (memset_rep(dest, val, count));
+}
+
+/*
+ * Requires:
+ *   The ranges do not overlap.
+ *
+ * Effects:
+ *   Copy short ranges a byte at a time, and longer ones with string
+ *   instructions: bytes up to a word boundary of "dest", then words, then
+ *   the remaining bytes.
+ */
+static void *
+memcpy_rep(void *dest, const void *src, size_t count)
+{
+        char *d = dest;
+        const char *s = src;
+        size_t n;
+
+        // Starting a string instruction costs more than a short loop.
+        if (count < MEM_REP_THRESHOLD) {
+                for (; count != 0; count--)
+                        *d++ = *s++;
+                return (dest);
+        }
+
+        n = -(uintptr_t)d & 3;
+        count -= n;
+        __asm__ __volatile__("rep movsb" : "+D" (d), "+S" (s), "+c" (n)
+            : : "memory");
+        n = count / 4;
+        count &= 3;
+        __asm__ __volatile__("rep movsl" : "+D" (d), "+S" (s), "+c" (n)
+            : : "memory");
+        for (; count != 0; count--)
+                *d++ = *s++;
+
+        return (dest);
+}
+
+/*
+ * Requires:
+ *   The ranges do not overlap and SSE2 is enabled.
+ *
+ * Effects:
+ *   Copy 64 bytes at a time with non-temporal stores once "dest" is 16
+ *   byte aligned, and the rest with memcpy_rep().  Interrupts are enabled
+ *   again between chunks of MEM_NT_CHUNK bytes.
+ */
+static void *
+memcpy_sse2(void *dest, const void *src, size_t count)
+{
+        char *d = dest;
+        const char *s = src;
+        unsigned int flags;
+        size_t n, chunk;
+
+        n = -(uintptr_t)d & 15;
+        memcpy_rep(d, s, n);
+        d += n;
+        s += n;
+        count -= n;
+
+        for (; count >= 64; count -= chunk) {
+                chunk = count < MEM_NT_CHUNK ? count & ~(size_t)63 :
+                    MEM_NT_CHUNK;
+                flags = irq_save();
+                for (n = chunk / 64; n > 0; n--, d += 64, s += 64) {
+                        __asm__ __volatile__(
+                            "movdqu   (%1), %%xmm0\n\t"
+                            "movdqu 16(%1), %%xmm1\n\t"
+                            "movdqu 32(%1), %%xmm2\n\t"
+                            "movdqu 48(%1), %%xmm3\n\t"
+                            "movntdq %%xmm0,   (%0)\n\t"
+                            "movntdq %%xmm1, 16(%0)\n\t"
+                            "movntdq %%xmm2, 32(%0)\n\t"
+                            "movntdq %%xmm3, 48(%0)"
+                            : : "r" (d), "r" (s) : "memory" XMM_CLOBBERS);
+                }
+                irq_restore(flags);
+        }
+        __asm__ __volatile__("sfence" : : : "memory");
+
+        memcpy_rep(d, s, count);
+
+        return (dest);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Fill short ranges a byte at a time, and longer ones with bytes up to a
+ *   word boundary of "dest", then rep stosd, then the remaining bytes.
+ */
+static void *
+memset_rep(void *dest, char val, size_t count)
+{
+        char *d = dest;
+        uint32_t pattern = (unsigned char)val * 0x01010101u;
+        size_t n;
+
+        if (count < MEM_REP_THRESHOLD) {
+                for (; count != 0; count--)
+                        *d++ = val;
+                return (dest);
+        }
+
+        for (; ((uintptr_t)d & 3) != 0; count--)
+                *d++ = val;
+        n = count / 4;
+        count &= 3;
+        __asm__ __volatile__("rep stosl" : "+D" (d), "+c" (n)
+            : "a" (pattern) : "memory");
+        for (; count != 0; count--)
+                *d++ = val;
+
+        return (dest);
+}
+
+/*
+ * Requires:
+ *   SSE2 is enabled.
+ *
+ * Effects:
+ *   Fill 64 bytes at a time with non-temporal stores once "dest" is 16
+ *   byte aligned, and the rest with memset_rep().  Interrupts are enabled
+ *   again between chunks of MEM_NT_CHUNK bytes, so the pattern is loaded
+ *   into XMM0 anew for each chunk.
+ */
+static void *
+memset_sse2(void *dest, char val, size_t count)
+{
+        char *d = dest;
+        uint32_t pattern = (unsigned char)val * 0x01010101u;
+        unsigned int flags;
+        size_t n, chunk;
+
+        n = -(uintptr_t)d & 15;
+        memset_rep(d, val, n);
+        d += n;
+        count -= n;
+
+        for (; count >= 64; count -= chunk) {
+                chunk = count < MEM_NT_CHUNK ? count & ~(size_t)63 :
+                    MEM_NT_CHUNK;
+                flags = irq_save();
+                __asm__ __volatile__(
+                    "movd %0, %%xmm0\n\t"
+                    "pshufd $0, %%xmm0, %%xmm0"
+                    : : "r" (pattern) : "memory" XMM_CLOBBERS);
+                for (n = chunk / 64; n > 0; n--, d += 64) {
+                        __asm__ __volatile__(
+                            "movntdq %%xmm0,   (%0)\n\t"
+                            "movntdq %%xmm0, 16(%0)\n\t"
+                            "movntdq %%xmm0, 32(%0)\n\t"
+                            "movntdq %%xmm0, 48(%0)"
+                            : : "r" (d) : "memory" XMM_CLOBBERS);
+                }
+                irq_restore(flags);
+        }
+        __asm__ __volatile__("sfence" : : : "memory");
+
+        memset_rep(d, val, count);
+
+        return (dest);
+}
+
+/*
+ * Requires:
+ *   "dest" lies above "src", less than "count" bytes past it.
+ *
+ * Effects:
+ *   Copy from the end down, so that no byte of "src" is overwritten before
+ *   it is read.  Short ranges are copied a byte at a time; longer ones copy
+ *   the bytes past the last whole word first, then the words with the
+ *   direction flag set.
+ */
+static void *
+memcpy_back(void *dest, const void *src, size_t count)
+{
+        char *d = (char *)dest + count;
+        const char *s = (const char *)src + count;
+        size_t n;
+
+        // Changing the direction flag costs more than a short loop.
+        if (count < MEM_REP_THRESHOLD) {
+                for (; count != 0; count--)
+                        *--d = *--s;
+                return (dest);
+        }
+
+        n = count / 4;
+        for (count &= 3; count != 0; count--)
+                *--d = *--s;
+
+        d -= 4;
+        s -= 4;
+        __asm__ __volatile__("std\n\trep movsl\n\tcld" : "+D" (d), "+S" (s),
+            "+c" (n) : : "memory");
+
+        return (dest);
 }
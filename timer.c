@@ -1,5 +1,58 @@
+/*
+ * The system clock and kernel timers.
+ *
+ * Time is counted in ticks of 1/TIMER_HZ seconds in tick_count.  Timers
+ * expire at an absolute tick and are kept in a hierarchical timing wheel,
+ * as in Varghese and Lauck.  The first level has a slot for each of the
+ * next TVR_SIZE ticks.  Each further level has TVN_SIZE slots, each as wide
+ * as one whole turn of the level below, so a timer goes into the level and
+ * slot its expiry falls in, found with a few shifts.  Slots are doubly
+ * linked lists, so arming and cancelling a timer are O(1).
+ *
+ * Every tick runs the timers in the current first level slot.  When the
+ * first level comes round to slot 0, the next slot of the second level is
+ * emptied and its timers are spread over the first level, which in turn
+ * may cascade from the level above it.  Each timer is moved at most once
+ * per level, so the work per tick is O(1) amortized, however many timers
+ * there are.
+ *
+ * The PIT does not interrupt every tick.  It runs in one-shot mode and is
+ * programmed for the tick of the next timer, or for as long as it can
+ * count if that is further off.  Each interrupt, and timer_ticks(), reads
+ * how far the counter got since it was last read and adds the whole ticks
+ * to tick_count, carrying the rest over.  An idle CPU is then only woken
+ * when a timer is due, and timers need not wait for a tick boundary of a
+ * slow periodic interrupt.  Arming a timer earlier than the one the PIT is
+ * programmed for reprograms it.  Building with -DTIMER_PERIODIC instead
+ * interrupts every tick, as before.
+ *
+ * Timer callbacks do not run in the interrupt.  Expired timers are moved
+ * to the ready queue, which timer_run_ready() empties in one batch once
+ * irq_handler() has acknowledged the interrupt and enabled interrupts
+ * again.  Callbacks may then take their time, and may arm, cancel or
+ * rearm timers.  A periodic timer is rearmed for its next period just
+ * before its callback runs, skipping any periods that were missed.
+ *
+ * sleep(), usleep() and nanosleep() do not go through the wheel, whose
+ * expiries are whole ticks.  A sleeper waits for a deadline in PIT cycles,
+ * about 0.84 us each, counted in pit_cycles.  Sleepers are kept in a list
+ * sorted by deadline, and the PIT is programmed for the earlier of the
+ * next timer and the first sleeper, so a sleep shorter than a tick ends
+ * on time rather than at the next tick.  The sleeper halts the CPU until
+ * then.  With -DTIMER_PERIODIC deadlines are rounded up to the next tick.
+ *
+ * clock_ns() is a monotonic clock in nanoseconds since timer_install().
+ * When the CPU has an invariant TSC, its rate is measured at boot against
+ * a count of PIT channel 2, and clock_ns() is a read of the TSC scaled
+ * with a multiply and a shift.  Otherwise it scales pit_cycles, which
+ * costs reading the PIT, and in periodic mode only moves once a tick.
+ */
 
 #include <system.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <cpu.h>
+#include <timer.h>
 
 #define CH1     0x40
 #define CH2     0x41
@@ -8,100 +61,384 @@
 
 #define BASE_CLOCK      1193180         // 1.19 MHz
 
+// Channel 0 commands: square wave, interrupt on terminal count, latch.
+#define PIT_PERIODIC    0x36
+#define PIT_ONESHOT     0x30
+#define PIT_LATCH       0x00
+
+/*
+ * PIT cycles in a tick, and the longest and shortest one-shot counts.  The
+ * counter wraps to 0xFFFF after reaching zero, so the longest count leaves
+ * room for the interrupt to be handled late without a whole wrap of the
+ * counter going unnoticed.
+ */
+#define PIT_TICK        (BASE_CLOCK / TIMER_HZ)
+#define PIT_MAX_COUNT   0xF000
+#define PIT_MIN_COUNT   32
+
+// Channel 2 command: interrupt on terminal count, which only sets OUT2.
+#define PIT_CH2_ONESHOT 0xB0
+
+// Port with the channel 2 gate and output, and the speaker enable.
+#define PIT_GATE        0x61
+#define GATE2           0x01
+#define SPEAKER         0x02
+#define OUT2            0x20
 
-const int timer_rate = 100;
-unsigned long tick_count = 0;
+/*
+ * The TSC is measured over CALIBRATE_RUNS counts of CALIBRATE_MS each, and
+ * the shortest is kept, as any other was stretched by something like an
+ * SMI.  A PIT that never counts down is given up on after CALIBRATE_LOOPS
+ * polls.
+ */
+#define CALIBRATE_MS    10
+#define CALIBRATE_RUNS  3
+#define CALIBRATE_LOOPS 1000000
+
+#define NSEC_PER_SEC    1000000000ull
+
+#define TVR_MASK        (TVR_SIZE - 1)
+#define TVN_MASK        (TVN_SIZE - 1)
 
+// Slot of level "n" above the first holding tick "t".
+#define TVN_INDEX(t, n) (((t) >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
 
-struct count {
-    volatile int count;
-    struct count *next;
+
+volatile unsigned long tick_count = 0;
+
+// A context waiting in sleep_until().
+struct sleeper {
+    struct sleeper *next;       // Sleeper with the next later deadline.
+    uint64_t deadline;          // Value of pit_cycles to wake at.
+    volatile bool done;
 };
 
-struct count *head = NULL;
+// Timing wheel, and the next tick it has to run.
+static struct timer *tv1[TVR_SIZE];
+static struct timer *tvn[TVN_LEVELS][TVN_SIZE];
+static unsigned long wheel_tick;
+
+// One-shot mode state.
+#ifdef TIMER_PERIODIC
+static const bool oneshot = false;
+#else
+static const bool oneshot = true;
+#endif
+static uint16_t pit_last;       // Counter value when last read or loaded.
+static uint32_t pit_carry;      // PIT cycles counted short of a tick.
+static unsigned long next_event; // Tick the PIT is programmed for.
+
+// Expired timers waiting for their callbacks, oldest first.
+static struct timer *ready;
+static struct timer **ready_tail = &ready;
+
+static uint64_t pit_cycles;     // PIT cycles counted since boot.
+static struct sleeper *sleepers; // Sorted by deadline.
+
+// Source of clock_ns(), which is cycles * clock_mult >> clock_shift.
+static bool clock_tsc;          // TSC rather than pit_cycles.
+static uint64_t clock_base;     // TSC at boot.
+static uint32_t clock_mult;
+static unsigned int clock_shift;
+
+
+static void set_timer_rate(int hz);
+static uint16_t pit_read(void);
+static void pit_account(void);
+static void pit_program(void);
+static unsigned long next_expiry(void);
+static void wheel_add(struct timer *t);
+static void wheel_del(struct timer *t);
+static void timer_unlink(struct timer *t);
+static unsigned int cascade(unsigned int level, unsigned int index);
+static void run_timers(void);
+static void sleep_until(uint64_t deadline);
+static void run_sleepers(void);
+static uint64_t ns_to_cycles(uint64_t ns);
+static void clock_init(void);
+static uint64_t tsc_calibrate(void);
+static uint64_t cycles_to_ns(uint64_t cycles);
 
 
-static struct count *add_wait_time(int ms);
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Initialize "t", not pending, to call "func" with "arg" when it fires.
+ */
+void
+timer_init(struct timer *t, void (*func)(void *), void *arg)
+{
+        t->next = NULL;
+        t->pprev = NULL;
+        t->period = 0;
+        t->func = func;
+        t->arg = arg;
+}
 
+/*
+ * Requires:
+ *   "t" was initialized by timer_init().
+ *
+ * Effects:
+ *   Make "t" fire at tick "expires", or at the next tick if that has
+ *   passed.  A pending timer is moved to the new tick.  A periodic timer
+ *   stays periodic.
+ */
+void
+timer_arm(struct timer *t, unsigned long expires)
+{
+        unsigned int flags;
+
+        flags = irq_save();
+        if (t->pprev != NULL)
+                timer_unlink(t);
+        t->expires = expires;
+        wheel_add(t);
+
+        if (oneshot && !TICK_AFTER_EQ(expires, next_event)) {
+                pit_account();
+                pit_program();
+        }
+        irq_restore(flags);
+}
 
 /*
- * Initialize timer to configured rate.
+ * Requires:
+ *   "t" is not pending.
+ *
+ * Effects:
+ *   Make "t" call "func" with "arg" once, at tick "deadline".
  */
-static void
-set_timer_rate(int hz)
+void
+timer_add(struct timer *t, unsigned long deadline, void (*func)(void *),
+    void *arg)
 {
-        int val = BASE_CLOCK / hz;
-        outportb(CMD, 0x36);
-        outportb(CH1, val & 0xFF);
-        outportb(CH1, val >> 8);
+        timer_init(t, func, arg);
+        timer_arm(t, deadline);
 }
 
+/*
+ * Requires:
+ *   "t" is not pending, and "period" is not 0.
+ *
+ * Effects:
+ *   Make "t" call "func" with "arg" at tick "deadline", and every "period"
+ *   ticks after that until it is cancelled.
+ */
+void
+timer_add_periodic(struct timer *t, unsigned long deadline,
+    unsigned long period, void (*func)(void *), void *arg)
+{
+        timer_init(t, func, arg);
+        t->period = period;
+        timer_arm(t, deadline);
+}
 
 /*
- * Handler to maintain a running count of the number of timer
- * ticks that have occurred.
+ * Requires:
+ *   "t" was initialized by timer_init().
+ *
+ * Effects:
+ *   Stop "t" from firing, even if it has expired and only its callback
+ *   is still to run, and end its period.  Returns true if it was pending.
+ *   A callback that is already running is not waited for.
+ */
+bool
+timer_cancel(struct timer *t)
+{
+        unsigned int flags;
+        bool pending;
+
+        flags = irq_save();
+        if ((pending = t->pprev != NULL))
+                timer_unlink(t);
+        t->period = 0;
+        irq_restore(flags);
+
+        return (pending);
+}
+
+/*
+ * Requires:
+ *   "t" was initialized by timer_init().
+ *
+ * Effects:
+ *   Returns true if "t" is armed and its callback has not been called
+ *   yet.
+ */
+bool
+timer_pending(struct timer *t)
+{
+        return (t->pprev != NULL);
+}
+
+/*
+ * Requires:
+ *   Interrupts are enabled, and the caller is not a timer callback.
+ *
+ * Effects:
+ *   Call the callbacks of the expired timers, including those that expire
+ *   meanwhile, rearming the periodic ones first.  Called by irq_handler()
+ *   after each interrupt.
  */
 void
-timer_handler(struct regs *r)
+timer_run_ready(void)
 {
-//        if (tick_count++ % 100 == 0)
-//                puts("One Second\n");
-        struct count *c = head;
-        while (c != NULL) {
-                c->count--;
-                c = c->next;
+        void (*func)(void *);
+        unsigned long now;
+        unsigned int flags;
+        struct timer *t;
+        void *arg;
+
+        flags = irq_save();
+        while ((t = ready) != NULL) {
+                timer_unlink(t);
+                func = t->func;
+                arg = t->arg;
+
+                if (t->period != 0) {
+                        now = timer_ticks();
+                        t->expires += t->period;
+                        if (TICK_AFTER_EQ(now, t->expires))
+                                t->expires += ((now - t->expires) /
+                                    t->period + 1) * t->period;
+                        timer_arm(t, t->expires);
+                }
+
+                irq_restore(flags);
+                func(arg);
+                flags = irq_save();
         }
+        irq_restore(flags);
 }
 
-static struct count *
-add_wait_time(int ms)
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the current tick, first adding the time the PIT has counted
+ *   since it was last read.
+ */
+unsigned long
+timer_ticks(void)
 {
-        struct count *c = malloc(sizeof(struct count));
-        if (c == NULL) {
-                puts("Out of Memory\n");
-                return NULL;
-        }
+        unsigned int flags;
+        unsigned long now;
 
-        c->count = ms;
-        c->next = head;
+        if (!oneshot)
+                return (tick_count);
 
-        // Block hardware interrupts while writing.
-//        BLOCK_INT;
-        head = c;
-//        ENABLE_INT;
+        flags = irq_save();
+        pit_account();
+        now = tick_count;
+        irq_restore(flags);
 
-        return c;
+        return (now);
 }
 
-static void
-remove_wait_time(struct count *c)
+/*
+ * Requires:
+ *   timer_install() has been called.
+ *
+ * Effects:
+ *   Returns the nanoseconds since timer_install(), never less than a
+ *   previous call returned.
+ */
+uint64_t
+clock_ns(void)
 {
-        struct count *cp = head;
-        while (cp != NULL && cp->next != c)
-                cp = cp->next;
+        unsigned int flags;
+        uint64_t cycles;
 
-        if (cp == NULL)
-                return;
+        if (clock_tsc)
+                return (cycles_to_ns(rdtsc() - clock_base));
 
-        cp->next = c->next;
-        free(c);
+        flags = irq_save();
+        if (oneshot)
+                pit_account();
+        cycles = pit_cycles;
+        irq_restore(flags);
+
+        return (cycles_to_ns(cycles));
 }
 
+/*
+ * Handler to maintain a running count of the number of timer
+ * ticks that have occurred.
+ */
 void
-sleep(int ms)
+timer_handler(struct regs *r)
 {
-        struct count *c = add_wait_time(ms / 10);
-
+        if (!oneshot) {
+                tick_count++;
+                pit_cycles += PIT_TICK;
+                run_sleepers();
+                run_timers();
+                return;
+        }
 
-        while (c->count > 0);
+        pit_account();
+        run_sleepers();
+        run_timers();
+        pit_program();
+}
 
-        remove_wait_time(c);
+/*
+ * Requires:
+ *   Interrupts are enabled, and the caller is not an interrupt handler.
+ *
+ * Effects:
+ *   Wait at least "ms" milliseconds, halting the CPU meanwhile.
+ */
+void
+sleep(int ms)
+{
+        if (ms > 0)
+                nanosleep((uint64_t)ms * 1000000);
 }
 
+/*
+ * Requires:
+ *   Interrupts are enabled, and the caller is not an interrupt handler.
+ *
+ * Effects:
+ *   Wait at least "us" microseconds, halting the CPU meanwhile.
+ */
+void
+usleep(unsigned long us)
+{
+        nanosleep((uint64_t)us * 1000);
+}
 
+/*
+ * Requires:
+ *   Interrupts are enabled, and the caller is not an interrupt handler.
+ *
+ * Effects:
+ *   Wait at least "ns" nanoseconds, to within a PIT cycle plus the time
+ *   taken to handle the interrupt, halting the CPU meanwhile.
+ */
+void
+nanosleep(uint64_t ns)
+{
+        unsigned int flags;
+        uint64_t now;
 
+        if (ns == 0)
+                return;
 
+        // Periodically, pit_cycles is up to a tick behind, so add one.
+        flags = irq_save();
+        if (oneshot)
+                pit_account();
+        now = oneshot ? pit_cycles : pit_cycles + PIT_TICK;
+        irq_restore(flags);
 
+        sleep_until(now + ns_to_cycles(ns));
+}
 
 /*
  * Initialize the timer and setup the IRQ handler.
@@ -110,8 +447,19 @@ sleep(int ms)
 void
 timer_install()
 {
-        // Set the timer rate to timer_rate Hz.
-        set_timer_rate(timer_rate);
+        unsigned int flags;
+
+        flags = irq_save();
+        clock_init();
+        wheel_tick = tick_count;
+
+        if (oneshot) {
+                pit_program();
+        } else {
+                // Set the timer rate to TIMER_HZ.
+                set_timer_rate(TIMER_HZ);
+        }
+        irq_restore(flags);
 
 //        int f = BASE_CLOCK / 500;
 //        outportb(CMD, 0xB6);
@@ -119,4 +467,403 @@ timer_install()
 //        outportb(CH2, f >> 8);
 
         irq_install_handler(0, timer_handler);
-}
\ No newline at end of file
+}
+
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Initialize timer to configured rate.
+ */
+static void
+set_timer_rate(int hz)
+{
+        int val = BASE_CLOCK / hz;
+        outportb(CMD, PIT_PERIODIC);
+        outportb(CH1, val & 0xFF);
+        outportb(CH1, val >> 8);
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled.
+ *
+ * Effects:
+ *   Returns the current value of the channel 0 counter.  In one-shot mode
+ *   it keeps counting down past zero, wrapping to 0xFFFF.
+ */
+static uint16_t
+pit_read(void)
+{
+        uint16_t lo;
+
+        outportb(CMD, PIT_LATCH);
+        lo = inportb(CH1);
+        return (lo | inportb(CH1) << 8);
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled, and the PIT is in one-shot mode.
+ *
+ * Effects:
+ *   Add the time counted since the counter was last read or loaded to
+ *   tick_count, carrying the part short of a tick to the next call.
+ */
+static void
+pit_account(void)
+{
+        uint16_t now = pit_read();
+        uint16_t elapsed = pit_last - now;
+        unsigned long ticks;
+
+        pit_carry += elapsed;
+        pit_cycles += elapsed;
+        pit_last = now;
+
+        ticks = pit_carry / PIT_TICK;
+        pit_carry -= ticks * PIT_TICK;
+        tick_count += ticks;
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled, and the time counted so far is accounted.
+ *
+ * Effects:
+ *   Load the PIT for the tick of the next timer or the deadline of the
+ *   first sleeper, whichever is earlier, as far as it can count.  The few
+ *   cycles between reading the counter and reloading it are lost.
+ */
+static void
+pit_program(void)
+{
+        unsigned long next = next_expiry();
+        uint32_t count;
+
+        if (TICK_AFTER_EQ(tick_count, next)) {
+                count = PIT_MIN_COUNT;
+        } else if (next - tick_count > PIT_MAX_COUNT / PIT_TICK + 1) {
+                count = PIT_MAX_COUNT;
+        } else {
+                count = (next - tick_count) * PIT_TICK - pit_carry;
+                if (count > PIT_MAX_COUNT)
+                        count = PIT_MAX_COUNT;
+                if (count < PIT_MIN_COUNT)
+                        count = PIT_MIN_COUNT;
+        }
+
+        if (sleepers != NULL && sleepers->deadline < pit_cycles + count) {
+                if (sleepers->deadline < pit_cycles + PIT_MIN_COUNT)
+                        count = PIT_MIN_COUNT;
+                else
+                        count = sleepers->deadline - pit_cycles;
+        }
+
+        outportb(CMD, PIT_ONESHOT);
+        outportb(CH1, count & 0xFF);
+        outportb(CH1, count >> 8);
+        pit_last = count;
+        next_event = next;
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled.
+ *
+ * Effects:
+ *   Returns the tick of the earliest timer in the first level of the
+ *   wheel, or of its next turn if there is none before that.  Timers in
+ *   the higher levels expire no earlier than the turn that cascades them,
+ *   so at the start of a turn, before the cascade, that is the answer.
+ */
+static unsigned long
+next_expiry(void)
+{
+        unsigned long left = TVR_SIZE - (wheel_tick & TVR_MASK);
+        unsigned long i;
+
+        if (left == TVR_SIZE)
+                return (wheel_tick);
+
+        for (i = 0; i < left; i++)
+                if (tv1[(wheel_tick + i) & TVR_MASK] != NULL)
+                        return (wheel_tick + i);
+        return (wheel_tick + left);
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled and "t" is not pending.
+ *
+ * Effects:
+ *   Put "t" into the wheel slot its expiry falls in.
+ */
+static void
+wheel_add(struct timer *t)
+{
+        unsigned long expires = t->expires;
+        unsigned long delta = expires - wheel_tick;
+        struct timer **slot;
+        unsigned int level;
+
+        if ((long)delta < 0) {
+                // Already due; run it with the next tick.
+                slot = &tv1[wheel_tick & TVR_MASK];
+        } else if (delta < TVR_SIZE) {
+                slot = &tv1[expires & TVR_MASK];
+        } else {
+                for (level = 0; level < TVN_LEVELS - 1; level++)
+                        if (delta < 1ul << (TVR_BITS + (level + 1) *
+                            TVN_BITS))
+                                break;
+                slot = &tvn[level][TVN_INDEX(expires, level)];
+        }
+
+        t->next = *slot;
+        if (t->next != NULL)
+                t->next->pprev = &t->next;
+        t->pprev = slot;
+        *slot = t;
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled and "t" is pending.
+ *
+ * Effects:
+ *   Take "t" out of its slot.
+ */
+static void
+wheel_del(struct timer *t)
+{
+        *t->pprev = t->next;
+        if (t->next != NULL)
+                t->next->pprev = t->pprev;
+        t->next = NULL;
+        t->pprev = NULL;
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled and "t" is pending.
+ *
+ * Effects:
+ *   Take "t" out of its wheel slot or the ready queue.
+ */
+static void
+timer_unlink(struct timer *t)
+{
+        if (ready_tail == &t->next)
+                ready_tail = t->pprev;
+        wheel_del(t);
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled.
+ *
+ * Effects:
+ *   Empty slot "index" of level "level" above the first, putting its
+ *   timers back into the wheel one level further down.  Returns "index",
+ *   which is 0 when the level above has to cascade too.
+ */
+static unsigned int
+cascade(unsigned int level, unsigned int index)
+{
+        struct timer *t, *next;
+
+        t = tvn[level][index];
+        tvn[level][index] = NULL;
+        for (; t != NULL; t = next) {
+                next = t->next;
+                wheel_add(t);
+        }
+
+        return (index);
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled.
+ *
+ * Effects:
+ *   Move the timers that expire at or before tick_count to the ready
+ *   queue.
+ */
+static void
+run_timers(void)
+{
+        unsigned int index, level;
+        struct timer *t;
+
+        while (TICK_AFTER_EQ(tick_count, wheel_tick)) {
+                index = wheel_tick & TVR_MASK;
+                for (level = 0; index == 0 && level < TVN_LEVELS; level++)
+                        if (cascade(level, TVN_INDEX(wheel_tick, level)) != 0)
+                                break;
+
+                while ((t = tv1[index]) != NULL) {
+                        wheel_del(t);
+                        t->pprev = ready_tail;
+                        *ready_tail = t;
+                        ready_tail = &t->next;
+                }
+                wheel_tick++;
+        }
+}
+
+/*
+ * Requires:
+ *   Interrupts are enabled, and the caller is not an interrupt handler.
+ *
+ * Effects:
+ *   Halt until pit_cycles reaches "deadline".  The list is checked with
+ *   interrupts disabled and cpu_idle() enables them only as it halts, so
+ *   the interrupt ending the sleep cannot come in between and be missed.
+ */
+static void
+sleep_until(uint64_t deadline)
+{
+        struct sleeper s, **p;
+        unsigned int flags;
+
+        s.deadline = deadline;
+        s.done = false;
+
+        flags = irq_save();
+        for (p = &sleepers; *p != NULL && (*p)->deadline <= deadline;
+            p = &(*p)->next)
+                ;
+        s.next = *p;
+        *p = &s;
+
+        if (oneshot && sleepers == &s) {
+                pit_account();
+                pit_program();
+        }
+
+        while (!s.done) {
+                cpu_idle();
+                irq_save();
+        }
+        irq_restore(flags);
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled, and the time counted so far is accounted.
+ *
+ * Effects:
+ *   End the sleeps whose deadline has been reached.
+ */
+static void
+run_sleepers(void)
+{
+        while (sleepers != NULL && sleepers->deadline <= pit_cycles) {
+                sleepers->done = true;
+                sleepers = sleepers->next;
+        }
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns "ns" nanoseconds in PIT cycles, rounded up so that a sleep is
+ *   never short.
+ */
+static uint64_t
+ns_to_cycles(uint64_t ns)
+{
+        return (ns / NSEC_PER_SEC * BASE_CLOCK +
+            (ns % NSEC_PER_SEC * BASE_CLOCK + NSEC_PER_SEC - 1) /
+            NSEC_PER_SEC);
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled, and cpu_init() has been called.
+ *
+ * Effects:
+ *   Choose the source of clock_ns(), measuring the TSC if it is to be
+ *   used, and set the scale from its cycles to nanoseconds.
+ */
+static void
+clock_init(void)
+{
+        uint64_t hz = 0;
+
+        if (cpu_has(CPU_TSC) && cpu_has(CPU_TSC_INVARIANT))
+                hz = tsc_calibrate();
+        if ((clock_tsc = hz != 0))
+                clock_base = rdtsc();
+        else
+                hz = BASE_CLOCK;
+
+        // The largest shift that keeps the multiplier in 32 bits.
+        for (clock_shift = 32; (NSEC_PER_SEC << clock_shift) / hz >=
+            1ull << 32; clock_shift--)
+                ;
+        clock_mult = ((NSEC_PER_SEC << clock_shift) + hz / 2) / hz;
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled, and the CPU has a TSC.
+ *
+ * Effects:
+ *   Returns the TSC rate in Hz, measured against PIT channel 2, or 0 if
+ *   the PIT does not count.
+ */
+static uint64_t
+tsc_calibrate(void)
+{
+        uint32_t count = BASE_CLOCK / 1000 * CALIBRATE_MS;
+        uint64_t start, elapsed, best = ~0ull;
+        unsigned int i, loops;
+        uint8_t gate;
+
+        gate = inportb(PIT_GATE);
+        outportb(PIT_GATE, (gate & ~SPEAKER) | GATE2);
+
+        for (i = 0; i < CALIBRATE_RUNS; i++) {
+                outportb(CMD, PIT_CH2_ONESHOT);
+                outportb(CH3, count & 0xFF);
+                outportb(CH3, count >> 8);
+                start = rdtsc();
+
+                for (loops = 0; !(inportb(PIT_GATE) & OUT2); loops++)
+                        if (loops == CALIBRATE_LOOPS) {
+                                outportb(PIT_GATE, gate);
+                                return (0);
+                        }
+
+                elapsed = rdtsc() - start;
+                if (elapsed < best)
+                        best = elapsed;
+        }
+        outportb(PIT_GATE, gate);
+
+        return (best * BASE_CLOCK / count);
+}
+
+/*
+ * Requires:
+ *   clock_init() has been called.
+ *
+ * Effects:
+ *   Returns "cycles" of the clock source in nanoseconds.  The high and low
+ *   halves are scaled apart, so that no product overflows.
+ */
+static uint64_t
+cycles_to_ns(uint64_t cycles)
+{
+        uint32_t lo = cycles, hi = cycles >> 32;
+
+        return (((uint64_t)hi * clock_mult << (32 - clock_shift)) +
+            ((uint64_t)lo * clock_mult >> clock_shift));
+}
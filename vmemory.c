@@ -1,8 +1,54 @@
 /*
  * The virtual memory system code goes in here.
+ *
+ * All memory is identity mapped with 4 MiB pages, so the kernel and the
+ * page frames are reached through a handful of TLB entries.  Pages
+ * mapped one at a time with map_page() get a page table from the page
+ * frame allocator; a 4 MiB page that has to be changed in part is first
+ * split into a page table mapping the same frames.
+ *
+ * The last directory entry points back at the directory itself.  Through
+ * it the page tables of the current address space appear as one 4 MiB
+ * array of entries at PT_WINDOW, indexed by virtual page number, and the
+ * directory as the last page of that window.  Finding the entry that maps
+ * an address is a shift and an add, with no walk from the root and no
+ * temporary mappings.
+ *
+ * Regions set up with vmem_reserve() are demand paged: nothing is mapped
+ * until a page is first touched, and the page fault handler then backs it
+ * with a zeroed frame.
+ *
+ * Kernel mappings are global, so they stay in the TLB across address space
+ * switches.  Changes to a range of pages collect the pages to invalidate
+ * in a batch: up to TLB_FLUSH_THRESHOLD of them are dropped one by one
+ * with invlpg, larger batches flush the whole TLB once.
+ *
+ * The Page Attribute Table is set up so that PG_PWT selects write-combining
+ * instead of write-through.  Frame buffers mapped that way let the CPU
+ * merge many small stores into a few bus bursts.
+ *
+ * vmem_clone() copies an address space without copying its pages.
+ * Directory entries without PG_USER map the kernel and are shared by all
+ * address spaces.  Kernel page tables are always entered into the
+ * kernel's directory, page_directory, as well as the current one, and an
+ * address space that lacks one picks it up from there on its first access
+ * to it, so kernel memory such as the demand paged heap looks the same
+ * everywhere.  A 4 MiB page cannot be brought back in line that way once
+ * copied, so after the first clone 4 MiB pages are no longer split.
+ *
+ * User page tables are copied instead, and their writable pages become
+ * read-only and PG_COW in both spaces, with the frame's reference count
+ * raised.  The first write to such a page faults, and the writer then gets
+ * a copy of its own, or simply write access back if nobody else refers to
+ * the frame any more.
  */
 
 #include <system.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <frame.h>
+#include <vmemory.h>
+#include <cpu.h>
 
 
 
@@ -10,10 +56,56 @@
 extern void paging_init();
 
 
+// Page Attribute Table MSR.  PA1 (PWT only) is write-combining instead of
+// write-through; the other entries keep their power-on types.
+#define MSR_PAT         0x277
+#define PAT_VALUE       0x0007040600070106ULL
 
-// Pointer to start of page directory.
+#define CR4_PGE         (1 << 7)
+
+// Bits of an entry protect_range() changes.
+#define PG_PROT         (PG_WRITE | PG_USER | PG_CACHE | PG_GLOBAL)
+
+
+
+// The kernel's page directory, and the current one, loaded by paging_init().
 uint32_t page_directory[1024]__attribute__((aligned(4096)));
-uint32_t page_table[1024]__attribute__((aligned(4096)));
+uint32_t *pd;
+
+
+// Demand paged regions.
+struct vm_region {
+    uintptr_t start;            // First byte of the region.
+    uintptr_t end;              // First byte past the region.
+    uint32_t flags;             // Entry bits of its pages.
+};
+
+static struct vm_region regions[VM_MAX_REGIONS];
+static unsigned int nregions;
+
+
+// TLB entries to drop after changing a range of pages.
+struct tlb_batch {
+    uintptr_t pages[TLB_FLUSH_THRESHOLD];
+    unsigned int n;             // Pages collected.
+    bool all;                   // Too many pages, flush everything.
+    bool global;                // A global entry changed.
+};
+
+static bool pge_enabled;        // CR4.PGE is set.
+static bool cloned;             // vmem_clone() has copied the directory.
+
+
+static void pat_init(void);
+static void pge_init(void);
+static uint32_t *get_table(uintptr_t virt, bool create, bool user);
+static bool pde_sync(uintptr_t virt);
+static int cow_fault(uintptr_t addr);
+static void batch_add(struct tlb_batch *b, uintptr_t virt, uint32_t old);
+static void batch_flush(struct tlb_batch *b);
+static void invlpg(uintptr_t virt);
+static void flush_tlb(void);
+static void flush_tlb_global(void);
 
 
 
@@ -32,15 +124,17 @@ uint32_t page_table[1024]__attribute__((aligned(4096)));
  * Bits 9-11    -       Available for OS use.
  * Bits 12-31   -       Page table address (4 KiB aligned).
  *
+ * With bit 7 set the entry maps a 4 MiB page instead: bits 6 and 8 are as
+ * in a page table entry and bits 22-31 hold the frame address.
+ *
  *
  * Page Table Entry:
  * ---------------------
  * Bits 0-5     -       Same as above.
  * Bit 6        -       Set to indicate page was written to.
  * Bit 7        -       0.
- * Bit 8        -       If set, TLB when not update address in cache if CR3
- *                      is reset. If page global enable bit is not set in CR4,
- *                      has no effect.
+ * Bit 8        -       If set, the TLB entry survives CR3 reloads (global
+ *                      page).  Has no effect unless CR4.PGE is set.
  * Bit 9-31     -       Same as above.
  *
  */
@@ -49,27 +143,718 @@ uint32_t page_table[1024]__attribute__((aligned(4096)));
 
 
 /*
- * Sets up tables for virtual memory system.
- * Note this must be called before switching to virtual mode.
+ * Sets up tables for virtual memory system and switches to virtual mode.
+ * "mem_top" is the end of the memory to identity map.
  */
 void
-vmem_init()
+vmem_init(uintptr_t mem_top)
 {
-        int i;
+        uint32_t i, nlarge;
 
-        // Initialize the Page Directory.
-        for (i = 0; i < 1024; i++)
-                page_directory[i] = 0x2;
-
-        for (i = 0; i < 1024; i ++)
-                page_table[i] = (i * 0x1000) | 3;
+        // Identity map the memory with 4 MiB pages.
+        nlarge = (mem_top - 1) / LARGE_PAGE_SIZE + 1;
+        if (nlarge > PD_RECURSIVE)
+                nlarge = PD_RECURSIVE;
 
-        page_directory[0] = ((unsigned int)page_table) | 3;
+        for (i = 0; i < 1024; i++)
+                page_directory[i] = PG_WRITE;
 
-        pd = (uint32_t *)page_directory;
+        for (i = 0; i < nlarge; i++)
+                page_directory[i] = (i * LARGE_PAGE_SIZE) | PG_GLOBAL |
+                    PG_PSE | PG_WRITE | PG_PRESENT;
 
         // Point last entry to page directory.
-        page_directory[1023] = ((unsigned int)page_directory[0]) | 3;
+        page_directory[PD_RECURSIVE] = (uint32_t)page_directory | PG_WRITE |
+            PG_PRESENT;
 
+        pd = page_directory;
+
+        pat_init();
         paging_init();
-}
\ No newline at end of file
+        pge_init();
+}
+
+/*
+ * Requires:
+ *   "virt" and "phys" are page aligned.
+ *
+ * Effects:
+ *   Map the 4 KiB page at "virt" to the frame at "phys" with the entry bits
+ *   in "flags".  Returns 0 on success or -1 if no page table could be
+ *   allocated.
+ */
+int
+map_page(uintptr_t virt, uintptr_t phys, uint32_t flags)
+{
+        return (map_range(virt, phys, PAGE_SIZE, flags));
+}
+
+/*
+ * Requires:
+ *   "virt" is page aligned.
+ *
+ * Effects:
+ *   Remove the mapping of the 4 KiB page at "virt", if any.  The frame it
+ *   mapped is not freed.
+ */
+void
+unmap_page(uintptr_t virt)
+{
+        unmap_range(virt, PAGE_SIZE);
+}
+
+/*
+ * Requires:
+ *   "virt", "phys" and "size" are page aligned.
+ *
+ * Effects:
+ *   Map the "size" bytes at "virt" to the frames from "phys" on with the
+ *   entry bits in "flags".  Returns 0 on success or -1 if a page table
+ *   could not be allocated, in which case a part of the range may be
+ *   mapped.
+ */
+int
+map_range(uintptr_t virt, uintptr_t phys, size_t size, uint32_t flags)
+{
+        struct tlb_batch b = { .n = 0, .all = false, .global = false };
+        uintptr_t end = virt + size;
+        unsigned int iflags;
+        uint32_t *pt, old;
+        int rv = 0;
+
+        iflags = irq_save();
+        for (; virt < end; virt += PAGE_SIZE, phys += PAGE_SIZE) {
+                if ((pt = get_table(virt, true, flags & PG_USER)) == NULL) {
+                        rv = -1;
+                        break;
+                }
+                old = pt[PT_INDEX(virt)];
+                pt[PT_INDEX(virt)] = (phys & PG_FRAME) | (flags & ~PG_FRAME) |
+                    PG_PRESENT;
+                // A table holding user pages is private to each address space.
+                if (flags & PG_USER)
+                        *PDE_VADDR(virt) |= PG_USER;
+                batch_add(&b, virt, old);
+        }
+        batch_flush(&b);
+        irq_restore(iflags);
+
+        return (rv);
+}
+
+/*
+ * Requires:
+ *   "virt" and "size" are page aligned.
+ *
+ * Effects:
+ *   Remove the mappings of the pages in the "size" bytes at "virt".  The
+ *   frames they mapped are not freed.
+ */
+void
+unmap_range(uintptr_t virt, size_t size)
+{
+        struct tlb_batch b = { .n = 0, .all = false, .global = false };
+        uintptr_t end = virt + size;
+        unsigned int iflags;
+        uint32_t *pt;
+
+        iflags = irq_save();
+        for (; virt < end; virt += PAGE_SIZE) {
+                if ((pt = get_table(virt, false, false)) == NULL)
+                        continue;
+                batch_add(&b, virt, pt[PT_INDEX(virt)]);
+                pt[PT_INDEX(virt)] = 0;
+        }
+        batch_flush(&b);
+        irq_restore(iflags);
+}
+
+/*
+ * Requires:
+ *   "virt" and "size" are page aligned.
+ *
+ * Effects:
+ *   Replace the access and memory type bits (PG_WRITE, PG_USER, PG_GLOBAL
+ *   and the PG_CACHE bits) of the mapped pages in the "size" bytes at
+ *   "virt" with those in "flags".  Returns 0 on success or -1 if a 4 MiB
+ *   page in the range could not be split, as after vmem_clone().
+ */
+int
+protect_range(uintptr_t virt, size_t size, uint32_t flags)
+{
+        struct tlb_batch b = { .n = 0, .all = false, .global = false };
+        uintptr_t end = virt + size;
+        unsigned int iflags;
+        uint32_t *pt, old;
+        int rv = 0;
+
+        iflags = irq_save();
+        for (; virt < end; virt += PAGE_SIZE) {
+                pde_sync(virt);
+                if ((*PDE_VADDR(virt) & PG_PRESENT) == 0)
+                        continue;
+                if ((pt = get_table(virt, false, false)) == NULL) {
+                        rv = -1;
+                        break;
+                }
+                old = pt[PT_INDEX(virt)];
+                if (!(old & PG_PRESENT))
+                        continue;
+                pt[PT_INDEX(virt)] = (old & ~PG_PROT) | (flags & PG_PROT);
+                if (flags & PG_USER)
+                        *PDE_VADDR(virt) |= PG_USER;
+                batch_add(&b, virt, old);
+        }
+        batch_flush(&b);
+        irq_restore(iflags);
+
+        return (rv);
+}
+
+/*
+ * Requires:
+ *   "start" and "size" are page aligned, and nothing is mapped in the
+ *   region.
+ *
+ * Effects:
+ *   Reserve "size" bytes at "start" to be backed with zeroed frames, mapped
+ *   with the entry bits in "flags", as they are first touched.  Returns 0
+ *   on success or -1 if there are too many regions.
+ */
+int
+vmem_reserve(uintptr_t start, size_t size, uint32_t flags)
+{
+        if (nregions == VM_MAX_REGIONS)
+                return (-1);
+
+        regions[nregions].start = start;
+        regions[nregions].end = start + size;
+        regions[nregions].flags = flags;
+        nregions++;
+
+        return (0);
+}
+
+/*
+ * Requires:
+ *   [start, end) is page aligned and lies in a region set up with
+ *   vmem_reserve().
+ *
+ * Effects:
+ *   Unmap the pages in [start, end) and free the frames backing them.  They
+ *   are backed again by fresh frames if they are touched later.
+ */
+void
+vmem_release(uintptr_t start, uintptr_t end)
+{
+        struct tlb_batch b = { .n = 0, .all = false, .global = false };
+        unsigned int iflags;
+        uint32_t *pt;
+
+        iflags = irq_save();
+        for (; start < end; start += PAGE_SIZE) {
+                if ((pt = get_table(start, false, false)) == NULL ||
+                    !(pt[PT_INDEX(start)] & PG_PRESENT))
+                        continue;
+                batch_add(&b, start, pt[PT_INDEX(start)]);
+                frame_unref((void *)(pt[PT_INDEX(start)] & PG_FRAME));
+                pt[PT_INDEX(start)] = 0;
+        }
+        batch_flush(&b);
+        irq_restore(iflags);
+}
+
+/*
+ * Requires:
+ *   "addr" and "err" are the faulting address and error code of a page
+ *   fault.
+ *
+ * Effects:
+ *   Back the page holding "addr" with a zeroed frame if it lies in a demand
+ *   paged region and is not mapped yet, or copy it if it is a write to a
+ *   copy-on-write page.  Returns 0 if the fault was handled or -1 if it is
+ *   a real fault or no frame is left.
+ */
+int
+vmem_fault(uintptr_t addr, uint32_t err)
+{
+        struct vm_region *r;
+        void *frame;
+
+        // Writes to shared pages get a copy; other protection violations
+        // are never resolved here.
+        if ((err & PF_PRESENT) && (err & PF_WRITE))
+                return (cow_fault(addr));
+        if (err & PF_PRESENT)
+                return (-1);
+
+        // Another address space may have mapped it since this one was
+        // cloned.
+        if (pde_sync(addr) && vmem_translate(addr) != (uintptr_t)-1)
+                return (0);
+
+        for (r = regions; r < &regions[nregions]; r++) {
+                if (addr >= r->start && addr < r->end)
+                        break;
+        }
+        if (r == &regions[nregions])
+                return (-1);
+
+        if ((frame = frame_alloc()) == NULL)
+                return (-1);
+        memset(frame, 0, PAGE_SIZE);
+
+        if (map_page(addr & PG_FRAME, (uintptr_t)frame, r->flags) == -1) {
+                frame_free(frame);
+                return (-1);
+        }
+
+        return (0);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Create a copy-on-write clone of the current address space.  Returns
+ *   its page directory or NULL if there were not enough frames.
+ */
+uint32_t *
+vmem_clone(void)
+{
+        uint32_t *dir, *pt, *npt, pte;
+        unsigned int iflags, i, j;
+
+        iflags = irq_save();
+
+        if ((dir = frame_alloc()) == NULL) {
+                irq_restore(iflags);
+                return (NULL);
+        }
+
+        for (i = 0; i < PD_RECURSIVE; i++) {
+                // Kernel mappings are shared.
+                if (!(pd[i] & PG_PRESENT) || !(pd[i] & PG_USER) ||
+                    (pd[i] & PG_PSE)) {
+                        dir[i] = pd[i];
+                        continue;
+                }
+
+                if ((npt = frame_alloc()) == NULL) {
+                        for (; i < PD_RECURSIVE; i++)
+                                dir[i] = 0;
+                        vmem_free(dir);
+                        flush_tlb();
+                        irq_restore(iflags);
+                        return (NULL);
+                }
+
+                pt = (uint32_t *)(pd[i] & PG_FRAME);
+                for (j = 0; j < 1024; j++) {
+                        pte = pt[j];
+                        if ((pte & PG_PRESENT) && (pte & PG_USER)) {
+                                if (pte & PG_WRITE)
+                                        pte = (pte & ~PG_WRITE) | PG_COW;
+                                pt[j] = pte;
+                                frame_ref((void *)(pte & PG_FRAME));
+                        }
+                        npt[j] = pte;
+                }
+                dir[i] = (uint32_t)npt | (pd[i] & ~PG_FRAME);
+        }
+
+        dir[PD_RECURSIVE] = (uint32_t)dir | PG_WRITE | PG_PRESENT;
+        cloned = true;
+
+        // The current space lost write access to its shared pages.
+        flush_tlb();
+        irq_restore(iflags);
+
+        return (dir);
+}
+
+/*
+ * Requires:
+ *   "dir" was returned by vmem_clone() and is not the current directory.
+ *
+ * Effects:
+ *   Free the private page tables of "dir", drop its references to the user
+ *   pages in them, and free the directory itself.
+ */
+void
+vmem_free(uint32_t *dir)
+{
+        uint32_t *pt;
+        unsigned int i, j;
+
+        for (i = 0; i < PD_RECURSIVE; i++) {
+                if (!(dir[i] & PG_PRESENT) || !(dir[i] & PG_USER) ||
+                    (dir[i] & PG_PSE))
+                        continue;
+                pt = (uint32_t *)(dir[i] & PG_FRAME);
+                for (j = 0; j < 1024; j++) {
+                        if ((pt[j] & PG_PRESENT) && (pt[j] & PG_USER))
+                                frame_unref((void *)(pt[j] & PG_FRAME));
+                }
+                frame_free(pt);
+        }
+        frame_free(dir);
+}
+
+/*
+ * Requires:
+ *   "dir" is the kernel's page directory or was returned by vmem_clone().
+ *
+ * Effects:
+ *   Make "dir" the current address space.
+ */
+void
+vmem_switch(uint32_t *dir)
+{
+        pd = dir;
+        __asm__ __volatile__("movl %0, %%cr3" : : "r" (dir) : "memory");
+}
+
+/*
+ * Requires:
+ *   [virt, virt + size) is mapped and page aligned, and "cache" is one of
+ *   PG_WB, PG_WC and PG_UC.
+ *
+ * Effects:
+ *   Change the memory type of the pages in [virt, virt + size) to "cache".
+ *   4 MiB pages in the range are split.  Returns 0 on success or -1 if a
+ *   page is not mapped, a page table could not be allocated or a 4 MiB
+ *   page could not be split after vmem_clone().
+ */
+int
+vmem_set_cache(uintptr_t virt, size_t size, uint32_t cache)
+{
+        struct tlb_batch b = { .n = 0, .all = false, .global = false };
+        uintptr_t end = virt + size;
+        unsigned int iflags;
+        uint32_t *pt, old;
+        int rv = 0;
+
+        iflags = irq_save();
+        for (; virt < end; virt += PAGE_SIZE) {
+                if ((pt = get_table(virt, false, false)) == NULL ||
+                    !((old = pt[PT_INDEX(virt)]) & PG_PRESENT)) {
+                        rv = -1;
+                        break;
+                }
+                pt[PT_INDEX(virt)] = (old & ~PG_CACHE) | cache;
+                batch_add(&b, virt, old);
+        }
+        batch_flush(&b);
+        irq_restore(iflags);
+
+        return (rv);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the address of the directory entry mapping "virt" in the
+ *   current address space.
+ */
+uint32_t *
+vmem_pde(uintptr_t virt)
+{
+        return (PDE_VADDR(virt));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the address of the page table entry mapping "virt" in the
+ *   current address space, or NULL if "virt" has no page table because it
+ *   is unmapped or in a 4 MiB page.
+ */
+uint32_t *
+vmem_pte(uintptr_t virt)
+{
+        uint32_t pde = *PDE_VADDR(virt);
+
+        if (!(pde & PG_PRESENT) || (pde & PG_PSE))
+                return (NULL);
+        return (PTE_VADDR(virt));
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Returns the physical address "virt" maps to in the current address
+ *   space, or (uintptr_t)-1 if it is not mapped.
+ */
+uintptr_t
+vmem_translate(uintptr_t virt)
+{
+        uint32_t pde = *PDE_VADDR(virt), pte;
+
+        if (!(pde & PG_PRESENT))
+                return ((uintptr_t)-1);
+        if (pde & PG_PSE)
+                return ((pde & PG_LARGE_FRAME) | (virt & ~PG_LARGE_FRAME));
+        if (!((pte = *PTE_VADDR(virt)) & PG_PRESENT))
+                return ((uintptr_t)-1);
+        return ((pte & PG_FRAME) | (virt & ~PG_FRAME));
+}
+
+
+/*
+ * The following routines are internal helper routines.
+ */
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Make PG_PWT select write-combining, if the CPU has a PAT.
+ */
+static void
+pat_init(void)
+{
+        if (cpu_has(CPU_PAT))
+                wrmsr(MSR_PAT, PAT_VALUE);
+}
+
+/*
+ * Requires:
+ *   Paging is enabled.
+ *
+ * Effects:
+ *   Set CR4.PGE, if the CPU has global pages, so that entries with
+ *   PG_GLOBAL survive CR3 reloads.
+ */
+static void
+pge_init(void)
+{
+        uint32_t cr4;
+
+        if (!cpu_has(CPU_PGE))
+                return;
+
+        __asm__ __volatile__("movl %%cr4, %0" : "=r" (cr4));
+        cr4 |= CR4_PGE;
+        __asm__ __volatile__("movl %0, %%cr4" : : "r" (cr4) : "memory");
+        pge_enabled = true;
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled.
+ *
+ * Effects:
+ *   Returns the page table mapping "virt", as seen through the recursive
+ *   slot.  A 4 MiB page covering "virt" is split into a page table mapping
+ *   the same frames, unless the directory has been cloned.  If there is no
+ *   table, an empty one is created if "create" is set, private to this
+ *   address space if "user" is set and otherwise shared as a kernel table.
+ *   Returns NULL if there is no table and none could be created.
+ */
+static uint32_t *
+get_table(uintptr_t virt, bool create, bool user)
+{
+        uint32_t *pde = PDE_VADDR(virt);
+        uint32_t *pt, frame, flags;
+        unsigned int i;
+
+        if (!user)
+                pde_sync(virt);
+
+        if ((*pde & PG_PRESENT) && !(*pde & PG_PSE))
+                return (PT_VADDR(virt));
+
+        if (!(*pde & PG_PRESENT) && !create)
+                return (NULL);
+
+        // Every clone has its own copy of a 4 MiB entry.
+        if ((*pde & PG_PRESENT) && cloned)
+                return (NULL);
+
+        if ((pt = frame_alloc()) == NULL)
+                return (NULL);
+
+        if (*pde & PG_PRESENT) {
+                // Fill the table through the identity map before it is live.
+                frame = *pde & PG_LARGE_FRAME;
+                flags = *pde & (PG_WRITE | PG_USER | PG_PWT | PG_PCD |
+                    PG_GLOBAL);
+                for (i = 0; i < 1024; i++)
+                        pt[i] = (frame + i * PAGE_SIZE) | flags | PG_PRESENT;
+                *pde = (uint32_t)pt | (*pde & PG_USER) | PG_WRITE |
+                    PG_PRESENT;
+                flush_tlb_global();
+        } else {
+                *pde = (uint32_t)pt | PG_WRITE | PG_PRESENT;
+                invlpg((uintptr_t)PT_VADDR(virt));
+                memset(PT_VADDR(virt), 0, PAGE_SIZE);
+        }
+
+        if (!user)
+                page_directory[PD_INDEX(virt)] = *pde;
+
+        return (PT_VADDR(virt));
+}
+
+/*
+ * Requires:
+ *   Interrupts are disabled.
+ *
+ * Effects:
+ *   If the current address space has no directory entry for "virt" but
+ *   the kernel's directory has a kernel one, copy it over.  Returns true if
+ *   it did.
+ */
+static bool
+pde_sync(uintptr_t virt)
+{
+        uint32_t *pde = PDE_VADDR(virt);
+        uint32_t kpde = page_directory[PD_INDEX(virt)];
+
+        if (pd == page_directory || (*pde & PG_PRESENT) ||
+            !(kpde & PG_PRESENT) || (kpde & PG_USER))
+                return (false);
+
+        *pde = kpde;
+        invlpg((uintptr_t)PT_VADDR(virt));
+        return (true);
+}
+
+/*
+ * Requires:
+ *   "addr" caused a write fault on a present page.
+ *
+ * Effects:
+ *   Give the writer its own copy of a copy-on-write page, or write access
+ *   back if it holds the only reference to the frame.  Returns 0 if the
+ *   fault was handled or -1 if the page is not copy-on-write or no frame is
+ *   left.
+ */
+static int
+cow_fault(uintptr_t addr)
+{
+        uint32_t *pt, pte;
+        void *old, *new;
+
+        if ((pt = get_table(addr, false, false)) == NULL)
+                return (-1);
+        pte = pt[PT_INDEX(addr)];
+        if (!(pte & PG_COW))
+                return (-1);
+
+        old = (void *)(pte & PG_FRAME);
+        if (frame_refcount(old) > 1) {
+                if ((new = frame_alloc()) == NULL)
+                        return (-1);
+                memcpy(new, old, PAGE_SIZE);
+                frame_unref(old);
+                pte = (uint32_t)new | (pte & ~PG_FRAME);
+        }
+
+        pt[PT_INDEX(addr)] = (pte & ~PG_COW) | PG_WRITE;
+        invlpg(addr);
+
+        return (0);
+}
+
+/*
+ * Requires:
+ *   "old" is the entry that mapped "virt" before it was changed.
+ *
+ * Effects:
+ *   Add "virt" to the pages whose TLB entries "b" drops.  Entries that were
+ *   not present are never cached and need no flush.
+ */
+static void
+batch_add(struct tlb_batch *b, uintptr_t virt, uint32_t old)
+{
+        if (!(old & PG_PRESENT))
+                return;
+        if (old & PG_GLOBAL)
+                b->global = true;
+        if (b->n == TLB_FLUSH_THRESHOLD)
+                b->all = true;
+        else
+                b->pages[b->n++] = virt;
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Drop the TLB entries collected in "b", one by one or all at once.
+ */
+static void
+batch_flush(struct tlb_batch *b)
+{
+        unsigned int i;
+
+        if (b->all && b->global)
+                flush_tlb_global();
+        else if (b->all)
+                flush_tlb();
+        else
+                for (i = 0; i < b->n; i++)
+                        invlpg(b->pages[i]);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Drop the TLB entry for the page at "virt".
+ */
+static void
+invlpg(uintptr_t virt)
+{
+        __asm__ __volatile__("invlpg (%0)" : : "r" (virt) : "memory");
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Drop all TLB entries by reloading CR3.
+ */
+static void
+flush_tlb(void)
+{
+        uint32_t cr3;
+
+        __asm__ __volatile__("movl %%cr3, %0; movl %0, %%cr3" : "=r" (cr3)
+            : : "memory");
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Drop all TLB entries, global ones included, by toggling CR4.PGE.
+ */
+static void
+flush_tlb_global(void)
+{
+        uint32_t cr4;
+
+        if (!pge_enabled) {
+                flush_tlb();
+                return;
+        }
+
+        __asm__ __volatile__("movl %%cr4, %0" : "=r" (cr4));
+        __asm__ __volatile__("movl %0, %%cr4; movl %1, %%cr4" : :
+            "r" (cr4 & ~CR4_PGE), "r" (cr4) : "memory");
+}